@@ -0,0 +1,130 @@
+#!/bin/sh
+# gen.sh generates an autotools project to benchmark mlibtool with: <libs>
+# libtool libraries of <sources> sources each, arranged in <depth> levels, in
+# which each library depends on <fanout> libraries of the level below it, and
+# a program using the top level
+
+usage() {
+    echo 'Use: gen.sh [-l <libs>] [-s <sources>] [-d <depth>] [-f <fanout>] <dir>' >&2
+    exit 1
+}
+
+LIBS=10
+SOURCES=20
+DEPTH=3
+FANOUT=2
+while getopts l:s:d:f: opt; do
+    case "$opt" in
+        l) LIBS="$OPTARG" ;;
+        s) SOURCES="$OPTARG" ;;
+        d) DEPTH="$OPTARG" ;;
+        f) FANOUT="$OPTARG" ;;
+        *) usage ;;
+    esac
+done
+shift `expr $OPTIND - 1`
+[ $# -eq 1 ] || usage
+DIR="$1"
+
+if [ -e "$DIR" ]; then
+    echo "gen.sh: $DIR already exists" >&2
+    exit 1
+fi
+mkdir -p "$DIR/m4" || exit 1
+
+cat > "$DIR/configure.ac" <<EOF
+AC_INIT([mlibtool-bench], [1.0])
+AC_CONFIG_SRCDIR([main.c])
+AC_CONFIG_AUX_DIR([build-aux])
+AC_CONFIG_MACRO_DIR([m4])
+AM_INIT_AUTOMAKE([foreign])
+LT_INIT
+AC_PROG_CC
+AC_CONFIG_FILES([Makefile])
+AC_OUTPUT
+EOF
+
+# the sources and Makefile.am
+awk -v dir="$DIR" -v libs="$LIBS" -v sources="$SOURCES" -v depth="$DEPTH" \
+    -v fanout="$FANOUT" 'BEGIN {
+    if (depth > libs) depth = libs
+    if (depth < 1) depth = 1
+
+    # libraries are numbered by level, level 0 being used by the program
+    for (i = 0; i < libs; i++) {
+        level[i] = int(i * depth / libs)
+        if (!(level[i] in first)) first[level[i]] = i
+        count[level[i]]++
+    }
+
+    mf = dir "/Makefile.am"
+    print "AUTOMAKE_OPTIONS = foreign" > mf
+    print "ACLOCAL_AMFLAGS = -I m4" > mf
+    print "" > mf
+
+    # list the deepest first, so a serial make builds them in order
+    printf "lib_LTLIBRARIES =" > mf
+    for (i = libs - 1; i >= 0; i--)
+        printf " libbench%d.la", i > mf
+    print "\n" > mf
+
+    for (i = 0; i < libs; i++) {
+        # pick its dependencies from the next level
+        ndeps = 0
+        l = level[i] + 1
+        if (l < depth) {
+            for (j = 0; j < fanout && j < count[l]; j++)
+                deps[ndeps++] = first[l] + (i + j) % count[l]
+        }
+
+        printf "libbench%d_la_SOURCES =", i > mf
+        for (s = 0; s < sources; s++) {
+            src = sprintf("l%d_s%d.c", i, s)
+            printf " %s", src > mf
+
+            out = dir "/" src
+            print "#include <stdio.h>" > out
+            print "#include <string.h>\n" > out
+            for (j = 0; j < ndeps; j++)
+                printf "int bench%d_0(int x);\n", deps[j] > out
+            printf "\nint bench%d_%d(int x)\n{\n", i, s > out
+            print "    char buf[64];" > out
+            printf "    snprintf(buf, sizeof(buf), \"%%d\", x + %d);\n", s > out
+            print "    x = (int) strlen(buf);" > out
+            for (j = 0; j < ndeps; j++)
+                printf "    x += bench%d_0(x);\n", deps[j] > out
+            print "    return x;\n}" > out
+            close(out)
+        }
+        print "" > mf
+        if (ndeps) {
+            printf "libbench%d_la_LIBADD =", i > mf
+            for (j = 0; j < ndeps; j++)
+                printf " libbench%d.la", deps[j] > mf
+            print "" > mf
+        }
+        print "libbench" i "_la_LDFLAGS = -version-info 1:0:0\n" > mf
+    }
+
+    out = dir "/main.c"
+    for (i = 0; i < count[0]; i++)
+        printf "int bench%d_0(int x);\n", i > out
+    print "\nint main(void)\n{\n    int x = 0;" > out
+    for (i = 0; i < count[0]; i++)
+        printf "    x += bench%d_0(x);\n", i > out
+    print "    return x == 0;\n}" > out
+    close(out)
+
+    print "bin_PROGRAMS = bench" > mf
+    print "bench_SOURCES = main.c" > mf
+    printf "bench_LDADD =" > mf
+    for (i = 0; i < count[0]; i++)
+        printf " libbench%d.la", i > mf
+    print "" > mf
+    close(mf)
+}' || exit 1
+
+if ! ( cd "$DIR" && autoreconf -fi ) > "$DIR/autoreconf.log" 2>&1; then
+    cat "$DIR/autoreconf.log" >&2
+    exit 1
+fi
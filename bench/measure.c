@@ -0,0 +1,91 @@
+/*
+ * measure: run a command, then append its wall time, the number of processes
+ * started while it ran and the peak RSS of it or any of its children to a
+ * file, as a line of name=value fields.
+ *
+ * The process count comes from /proc/stat, so it counts every process started
+ * on the system, and is only meaningful when nothing else is running.
+ *
+ * Use: measure <file> <name> <command...>
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* the number of processes started since boot, or 0 if unknown */
+static long long processes(void)
+{
+    FILE *f;
+    char line[256];
+    long long ret = 0;
+
+    f = fopen("/proc/stat", "r");
+    if (!f) return 0;
+    while (fgets(line, sizeof(line), f))
+        if (!strncmp(line, "processes ", 10))
+            ret = atoll(line + 10);
+    fclose(f);
+    return ret;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *out;
+    struct rusage ru;
+    double start;
+    long long procs;
+    pid_t pid;
+    int status;
+
+    if (argc < 4) {
+        fprintf(stderr, "Use: measure <file> <name> <command...>\n");
+        return 1;
+    }
+
+    procs = processes();
+    start = now();
+    pid = fork();
+    if (pid == 0) {
+        execvp(argv[3], argv + 3);
+        perror(argv[3]);
+        _exit(127);
+    } else if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (waitpid(pid, &status, 0) != pid) {
+        perror("waitpid");
+        return 1;
+    }
+
+    /* the command has waited for its children, so this covers theirs */
+    getrusage(RUSAGE_CHILDREN, &ru);
+
+    out = fopen(argv[1], "a");
+    if (!out) {
+        perror(argv[1]);
+        return 1;
+    }
+    fprintf(out, "%s\twall=%.3f\tprocs=%lld\tmaxrss=%ld\tstatus=%d\n",
+            argv[2], now() - start, processes() - procs,
+            (long) ru.ru_maxrss, WIFEXITED(status) ? WEXITSTATUS(status) : 128);
+    fclose(out);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
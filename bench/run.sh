@@ -0,0 +1,247 @@
+#!/bin/sh
+# run.sh configures, builds and installs a project made by gen.sh (or any
+# autotools project using libtool), once with its own libtool and once through
+# mlibtool, and reports the wall time, process count and peak RSS of each step
+# and of each libtool mode.
+#
+# With -b <baseline>, it instead builds only through mlibtool, and compares
+# mlibtool's own time per invocation (its wall time less its children's) in
+# each mode against <baseline>, failing if any has grown by more than
+# <percent>. If <baseline> doesn't exist, it's written.
+
+usage() {
+    echo 'Use: run.sh [-j <jobs>] [-r <runs>] [-m <mlibtool>] [-b <baseline> [-t <percent>]]' >&2
+    echo '            <project> [<work dir>]' >&2
+    exit 1
+}
+
+BENCH=`cd "\`dirname "$0"\`" && pwd`
+JOBS=1
+RUNS=3
+MLIBTOOL=
+BASELINE=
+TOLERANCE=25
+while getopts j:r:m:b:t: opt; do
+    case "$opt" in
+        j) JOBS="$OPTARG" ;;
+        r) RUNS="$OPTARG" ;;
+        m) MLIBTOOL="$OPTARG" ;;
+        b) BASELINE="$OPTARG" ;;
+        t) TOLERANCE="$OPTARG" ;;
+        *) usage ;;
+    esac
+done
+shift `expr $OPTIND - 1`
+[ $# -eq 1 -o $# -eq 2 ] || usage
+PROJECT=`cd "$1" && pwd` || exit 1
+WORK="${2:-$PROJECT.work}"
+mkdir -p "$WORK/bin" || exit 1
+WORK=`cd "$WORK" && pwd`
+RESULTS="$WORK/results"
+rm -f "$RESULTS" "$WORK"/stats.*
+
+# build our tools
+CC="${CC:-cc}"
+$CC -O2 -o "$WORK/bin/measure" "$BENCH/measure.c" || exit 1
+if [ -z "$MLIBTOOL" ]; then
+    $CC -O2 -o "$WORK/bin/mlibtool" "$BENCH/../mlibtool.c" || exit 1
+else
+    ln -sf "`cd "\`dirname "$MLIBTOOL"\`" && pwd`/`basename "$MLIBTOOL"`" \
+        "$WORK/bin/mlibtool" || exit 1
+fi
+PATH="$WORK/bin:$PATH"
+export PATH
+
+# libtool runs through this, to be measured by its mode
+cat > "$WORK/bin/lt-measure" <<EOF
+#!/bin/sh
+mode=unknown
+for arg in "\$@"; do
+    case "\$arg" in
+        --mode=*) mode=\`expr "x\$arg" : 'x--mode=\(.*\)'\` ; break ;;
+    esac
+done
+exec "$WORK/bin/measure" "$RESULTS" "\$BENCH_TOOL mode \$mode" "\$@"
+EOF
+chmod +x "$WORK/bin/lt-measure"
+
+# build the project once, with libtool or mlibtool
+build() {
+    BENCH_TOOL="$1"
+    export BENCH_TOOL
+    B="$WORK/build"
+    rm -rf "$B"
+    cp -R "$PROJECT" "$B" && cd "$B" || exit 1
+
+    measure "$RESULTS" "$BENCH_TOOL step configure" \
+        ./configure --prefix="$B/prefix" > "$WORK/$BENCH_TOOL.log" 2>&1 || fail
+    if [ "$BENCH_TOOL" = "mlibtool" ]; then
+        LT="lt-measure `"$BENCH/../acmlibtool"`"
+    else
+        LT="lt-measure $B/libtool"
+    fi
+    measure "$RESULTS" "$BENCH_TOOL step build" \
+        make -j"$JOBS" LIBTOOL="$LT" >> "$WORK/$BENCH_TOOL.log" 2>&1 || fail
+    measure "$RESULTS" "$BENCH_TOOL step install" \
+        make install LIBTOOL="$LT" >> "$WORK/$BENCH_TOOL.log" 2>&1 || fail
+
+    # make sure it works (mlibtool doesn't give installed programs an rpath)
+    for prog in "$B"/prefix/bin/*; do
+        LD_LIBRARY_PATH="$B/prefix/lib" "$prog" || fail
+    done
+    cd "$WORK"
+}
+
+fail() {
+    echo "run.sh: $BENCH_TOOL failed, see $WORK/$BENCH_TOOL.log" >&2
+    exit 1
+}
+
+i=1
+while [ $i -le $RUNS ]; do
+    echo "run $i of $RUNS" >&2
+    if [ -z "$BASELINE" ]; then
+        build libtool
+    fi
+    MLIBTOOL_STATS="$WORK/stats.$i"
+    export MLIBTOOL_STATS
+    build mlibtool
+    unset MLIBTOOL_STATS
+    i=`expr $i + 1`
+done
+
+if [ -z "$BASELINE" ]; then
+    # the fastest run of each step, and the totals per mode
+    awk -F '\t' -v runs="$RUNS" -v jobs="$JOBS" '
+    {
+        for (i = 2; i <= NF; i++) {
+            eq = index($i, "=")
+            f[substr($i, 1, eq - 1)] = substr($i, eq + 1)
+        }
+        split($1, name, " ")
+        tool = name[1]
+        step = name[3]
+        if (name[2] == "step") {
+            if (!(step in steps)) stepList[++nsteps] = step
+            steps[step] = 1
+            key = tool SUBSEP step
+            if (!(key in wall) || f["wall"] < wall[key]) {
+                wall[key] = f["wall"]
+                procs[key] = f["procs"]
+            }
+        } else {
+            if (!(step in modes)) modeList[++nmodes] = step
+            modes[step] = 1
+            key = tool SUBSEP step
+            count[key]++
+            mwall[key] += f["wall"]
+            mprocs[key] += f["procs"]
+        }
+        if (f["maxrss"] > rss[name[2] SUBSEP key])
+            rss[name[2] SUBSEP key] = f["maxrss"]
+    }
+
+    function row(label, tool, rssKey, w, p, n) {
+        printf "%-10s %-9s %10.3f %9d %9dM", label, tool, w, p, rss[rssKey] / 1024
+        if (n) printf " %9d", n
+        printf "\n"
+    }
+
+    END {
+        printf "%-10s %-9s %10s %9s %10s\n", "step", "tool", "seconds",
+               "processes", "max rss"
+        for (i = 1; i <= nsteps; i++) {
+            s = stepList[i]
+            row(s, "libtool", "step" SUBSEP "libtool" SUBSEP s,
+                wall["libtool" SUBSEP s], procs["libtool" SUBSEP s], 0)
+            row(s, "mlibtool", "step" SUBSEP "mlibtool" SUBSEP s,
+                wall["mlibtool" SUBSEP s], procs["mlibtool" SUBSEP s], 0)
+            if (wall["mlibtool" SUBSEP s] > 0)
+                printf "%-10s %-9s %9.2fx\n", s, "speedup",
+                       wall["libtool" SUBSEP s] / wall["mlibtool" SUBSEP s]
+        }
+
+        printf "\n%-10s %-9s %10s %9s %10s %9s\n", "mode", "tool", "seconds",
+               "processes", "max rss", "commands"
+        for (i = 1; i <= nmodes; i++) {
+            m = modeList[i]
+            for (t = 0; t < 2; t++) {
+                tool = t ? "mlibtool" : "libtool"
+                key = tool SUBSEP m
+                if (!(key in count)) continue
+                row(m, tool, "mode" SUBSEP key, mwall[key] / runs,
+                    mprocs[key] / runs, count[key] / runs)
+            }
+        }
+        if (jobs > 1)
+            print "(with -j > 1, concurrent commands count each other\47s processes)"
+    }' "$RESULTS"
+    exit 0
+fi
+
+# regression mode: mlibtool's own time per invocation in each mode, from the
+# fastest run
+HAVEBASE=0
+set -- "$WORK"/stats.*
+if [ -f "$BASELINE" ]; then
+    HAVEBASE=1
+    set -- "$BASELINE" "$@"
+fi
+awk -F '\t' -v baseline="$BASELINE" -v haveBase="$HAVEBASE" \
+    -v tolerance="$TOLERANCE" '
+FILENAME == baseline {
+    base[$1] = $2
+    next
+}
+
+{
+    delete f
+    for (i = 1; i <= NF; i++) {
+        eq = index($i, "=")
+        if (eq) f[substr($i, 1, eq - 1)] = substr($i, eq + 1)
+    }
+    if (f["libtool"] != 0) next
+
+    m = f["mode"]
+    if (!(m in modes)) modeList[++nmodes] = m
+    modes[m] = 1
+    over = f["wall"] - f["child"]
+    if (over < 0) over = 0
+    sum[m SUBSEP FILENAME] += over
+    count[m SUBSEP FILENAME]++
+    files[FILENAME] = 1
+}
+
+END {
+    failed = 0
+    for (i = 1; i <= nmodes; i++) {
+        m = modeList[i]
+        best = -1
+        for (file in files) {
+            if (!((m SUBSEP file) in count)) continue
+            ms = 1000 * sum[m SUBSEP file] / count[m SUBSEP file]
+            if (best < 0 || ms < best) best = ms
+        }
+
+        if (!haveBase) {
+            printf "%s\t%.4f\n", m, best > (baseline ".new")
+            printf "%-10s %8.3fms\n", m, best
+        } else if (m in base) {
+            # allow a little noise in very small times
+            limit = base[m] * (1 + tolerance / 100) + 0.1
+            printf "%-10s %8.3fms (baseline %.3fms)", m, best, base[m]
+            if (best > limit) {
+                printf " REGRESSED"
+                failed = 1
+            }
+            printf "\n"
+        }
+    }
+    exit failed
+}' "$@"
+status=$?
+
+if [ "$HAVEBASE" = 0 ]; then
+    mv "$BASELINE.new" "$BASELINE" && echo "wrote $BASELINE" >&2
+fi
+exit $status
@@ -32,12 +32,16 @@
  */
 
 #define _XOPEN_SOURCE 500
+#define _DEFAULT_SOURCE /* for common extensions, e.g. syscall */
 
 /* headers used in written .l* files */
 #define SANE_HEADER "# SYSTEM_IS_SANE\n"
 #define PACKAGE "libtool (mlibtool) " MLIBTOOL_VERSION
 #define PACKAGE_HEADER "# Generated by " PACKAGE "\n"
 
+/* header of the dependency closure index we keep next to .la files */
+#define CLOSURE_HEADER "# mlibtool closure index 1\n"
+
 /* systems we define as sane, based on preprocessor macros on the /target/ (not
  * this build) */
 #define SANE "__ELF__ && (" /* we only support ELF */ \
@@ -50,14 +54,22 @@
              ")"
 
 /* our binary runner script */
+#define BIN_SCRIPT_PATH "$LD_LIBRARY_PATH${LD_LIBRARY_PATH:+:}"
 #define BIN_SCRIPT_1 "#!/bin/sh\n" \
                      PACKAGE_HEADER \
-                     "LD_LIBRARY_PATH=\"$LD_LIBRARY_PATH${LD_LIBRARY_PATH:+:}"
+                     "LD_LIBRARY_PATH=\"" BIN_SCRIPT_PATH
 #define BIN_SCRIPT_2 "\"\n" \
                      "export LD_LIBRARY_PATH\n" \
                      "exec \""
 #define BIN_SCRIPT_3 "\" \"$@\"\n"
 
+/* how the runner script starts, in any version of mlibtool */
+#define BIN_SCRIPT_MAGIC "#!/bin/sh\n# Generated by libtool (mlibtool) "
+
+/* and how GNU libtool's wrapper scripts mark themselves, within their first
+ * four lines (followed by the package, naming libtool) */
+#define GNU_SCRIPT_MAGIC "\n# Generated by "
+
 /* macro to fail with perror if a function fails */
 #define ORX(into, func, bad, args) do { \
     (into) = func args; \
@@ -73,7 +85,7 @@
     (into) = func args; \
     if ((into) == bad) { \
         perror("mlibtool: " #func); \
-        execLibtool(opt); \
+        execLibtool(opt, #func " failed"); \
     } \
 } while (0)
 
@@ -95,13 +107,39 @@ int main(int argc, char **argv)
 }
 #else
 
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(_POSIX_SPAWN) && _POSIX_SPAWN > 0
+#define USE_POSIX_SPAWN
+#include <spawn.h>
+#endif
+
+extern char **environ;
 
 /* a simple buffer type for our persistent char ** commands */
 struct Buffer {
@@ -131,14 +169,776 @@ struct Buffer {
     free((ubuf).buf); \
 } while (0)
 
+/* grow an array of sz elements (used in use) to fit another */
+#define GROW_ARRAY(opt, arr, used, sz) do { \
+    if ((used) >= (sz)) { \
+        (sz) = (sz) ? (sz) * 2 : BUFFER_DEFAULT_SZ; \
+        ORL((arr), realloc, NULL, ((arr), (sz) * sizeof(*(arr)))); \
+    } \
+} while (0)
+
+/* our modes */
+enum Mode {
+    MODE_UNKNOWN = 0,
+    MODE_COMPILE,
+    MODE_LINK,
+    MODE_INSTALL,
+    MODE_EXECUTE
+};
+
+/* options necessary to handle modes */
+/* the arena holds everything allocated for one invocation, in blocks */
+#define ARENA_BLOCK_SZ 65536
+#define ARENA_ALIGN 16
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used, sz;
+    size_t align; /* keep the data after this aligned */
+};
+
+struct Options {
+    int dryRun, quiet, retryIfFail;
+    int buildShared, buildStatic; /* also effects -fPIC in .o files */
+    int maxJobs; /* maximum number of children to run at once */
+    int defaultPic; /* the compiler generates PIC without -fPIC */
+    int forkLaunch; /* launch children with fork+exec instead of posix_spawn */
+    int optimistic; /* check sanity during compiles instead of probing */
+    int checkSanity; /* sanity is unknown, so the compile must check it */
+    int externalAr; /* use ar and ranlib instead of writing archives */
+    int thinConvenience; /* make convenience libraries thin archives */
+    int externalInstall; /* use install and cp instead of copying files */
+    int linkCache; /* don't relink when nothing has changed */
+    char *objectCache; /* object cache directory, "" for the default */
+    long long objectCacheMax; /* and its size limit */
+    int objectCacheLink; /* hard link objects to and from it */
+    char *fallbackLog; /* log falling back to libtool here */
+    int runpath; /* link programs to run in place, without a wrapper */
+
+    int arglt; /* where the libtool command starts */
+    int argc;
+    char **argv, **cmd;
+
+    struct ArenaBlock *arena;
+};
+
+/* Launch a child running cmd, with its stdin and stdout redirected to fdin
+ * and fdout (or inherited if -1). Any other descriptors the child shouldn't
+ * have must be close-on-exec. Returns the pid, or -1 with errno set. */
+static pid_t launch(struct Options *opt, char *const *cmd, int fdin, int fdout)
+{
+    pid_t pid;
+
+#ifdef USE_POSIX_SPAWN
+    if (!opt->forkLaunch) {
+        posix_spawn_file_actions_t fa, *fap = NULL;
+        int err;
+
+        if (fdin >= 0 || fdout >= 0) {
+            posix_spawn_file_actions_init(&fa);
+            if (fdin >= 0)
+                posix_spawn_file_actions_adddup2(&fa, fdin, 0);
+            if (fdout >= 0)
+                posix_spawn_file_actions_adddup2(&fa, fdout, 1);
+            fap = &fa;
+        }
+
+        err = posix_spawnp(&pid, cmd[0], fap, NULL, cmd, environ);
+        if (fap)
+            posix_spawn_file_actions_destroy(fap);
+
+        if (err) {
+            errno = err;
+            return -1;
+        }
+        return pid;
+    }
+#endif
+
+    pid = fork();
+    if (pid == 0) {
+        if (fdin >= 0 && dup2(fdin, 0) < 0) _exit(1);
+        if (fdout >= 0 && dup2(fdout, 1) < 0) _exit(1);
+        execvp(cmd[0], cmd);
+        perror(cmd[0]);
+        _exit(1);
+    }
+    return pid;
+}
+
+
+/* In --server mode, the server keeps the results of expensive lookups
+ * (system sanity, .la contents, canonical library directories) in memory,
+ * and the workers it forks for each request inherit them. Each entry is only
+ * valid while the mtime and size of the file it was derived from stay the
+ * same. Workers report new entries back to the server over memCacheFd. */
+struct CacheEntry {
+    char *key, *path, *value;
+    long long mtime, size;
+};
+
+static struct CacheEntry *memCache = NULL;
+static size_t memCacheSz = 0, memCacheUsed = 0;
+static int memCacheFd = -1;
+static int inServerWorker = 0;
+
+/* FNV-1a, for hashing cache keys */
+static unsigned long long hashStr(const char *str)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for (; *str; str++) {
+        h ^= (unsigned char) *str;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Find the slot for a key in the memory cache */
+static struct CacheEntry *memCacheSlot(const char *key)
+{
+    size_t i = hashStr(key) & (memCacheSz - 1);
+    while (memCache[i].key && strcmp(memCache[i].key, key))
+        i = (i + 1) & (memCacheSz - 1);
+    return &memCache[i];
+}
+
+/* Add an entry to the memory cache (in the server), replacing any old one */
+static void memCacheInsert(const char *key, const char *path,
+                           long long mtime, long long size,
+                           const char *value)
+{
+    struct CacheEntry *ent;
+
+    /* keep the table at most half full */
+    if ((memCacheUsed + 1) * 2 > memCacheSz) {
+        struct CacheEntry *old = memCache;
+        size_t oldSz = memCacheSz, i;
+
+        memCacheSz = memCacheSz ? memCacheSz * 2 : 256;
+        ORX(memCache, calloc, NULL, (memCacheSz, sizeof(struct CacheEntry)));
+        for (i = 0; i < oldSz; i++) {
+            if (old[i].key)
+                *memCacheSlot(old[i].key) = old[i];
+        }
+        free(old);
+    }
+
+    ent = memCacheSlot(key);
+    if (ent->key) {
+        free(ent->key);
+        free(ent->path);
+        free(ent->value);
+    } else {
+        memCacheUsed++;
+    }
+    ORX(ent->key, strdup, NULL, (key));
+    ORX(ent->path, strdup, NULL, (path));
+    ORX(ent->value, strdup, NULL, (value));
+    ent->mtime = mtime;
+    ent->size = size;
+}
+
+/* Look up a cached value, if it's still valid */
+static const char *memCacheGet(const char *key)
+{
+    struct CacheEntry *ent;
+    struct stat sb;
+
+    if (!memCacheUsed) return NULL;
+    ent = memCacheSlot(key);
+    if (!ent->key) return NULL;
+    if (stat(ent->path, &sb) != 0 ||
+        (long long) sb.st_mtime != ent->mtime ||
+        (long long) sb.st_size != ent->size)
+        return NULL;
+    return ent->value;
+}
+
+/* Report a new cache entry to the server. sb must describe path as it was
+ * before value was derived from it. */
+static void memCachePut(const char *key, const char *path, struct stat *sb,
+                        const char *value)
+{
+    char nums[64];
+    size_t keyLen, pathLen, numsLen, valueLen;
+    char *rec;
+
+    if (memCacheFd < 0) return;
+
+    keyLen = strlen(key) + 1;
+    pathLen = strlen(path) + 1;
+    numsLen = sprintf(nums, "%lld %lld", (long long) sb->st_mtime,
+                      (long long) sb->st_size) + 1;
+    valueLen = strlen(value) + 1;
+
+    /* records are key, path, "mtime size" and value, each NUL-terminated */
+    rec = malloc(keyLen + pathLen + numsLen + valueLen);
+    if (!rec) return;
+    memcpy(rec, key, keyLen);
+    memcpy(rec + keyLen, path, pathLen);
+    memcpy(rec + keyLen + pathLen, nums, numsLen);
+    memcpy(rec + keyLen + pathLen + numsLen, value, valueLen);
+
+    /* the pipe may be full, but the server is always reading it */
+    if (write(memCacheFd, rec, keyLen + pathLen + numsLen + valueLen) < 0)
+        memCacheFd = -1;
+    free(rec);
+}
+
+/* Is the memory cache in use (i.e., are we a server worker)? */
+#define MEM_CACHE_ACTIVE() (memCacheFd >= 0)
+
+/* Read exactly len bytes, returning 0 on success */
+static int readAll(int fd, void *buf, size_t len)
+{
+    char *cbuf = buf;
+    while (len) {
+        ssize_t rd = read(fd, cbuf, len);
+        if (rd <= 0) {
+            if (rd < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        cbuf += rd;
+        len -= rd;
+    }
+    return 0;
+}
+
+/* Write exactly len bytes, returning 0 on success */
+static int writeAll(int fd, const void *buf, size_t len)
+{
+    const char *cbuf = buf;
+    while (len) {
+        ssize_t wr = write(fd, cbuf, len);
+        if (wr <= 0) {
+            if (wr < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        cbuf += wr;
+        len -= wr;
+    }
+    return 0;
+}
+
+/* Copy len bytes from inFd at inOff to the current position of outFd,
+ * within the kernel where possible. Returns 0 on success. */
+static int copyRange(int inFd, off_t inOff, int outFd, size_t len)
+{
+    char *buf;
+    int ret = 0;
+
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    while (len) {
+        long cp = syscall(SYS_copy_file_range, inFd, &inOff, outFd, NULL, len, 0);
+        if (cp <= 0) {
+            if (cp < 0 && errno == EINTR) continue;
+            break; /* not supported here, so copy it ourselves */
+        }
+        inOff += cp;
+        len -= cp;
+    }
+    if (!len) return 0;
+#endif
+
+    if (!(buf = malloc(65536))) return -1;
+    while (len) {
+        ssize_t rd = pread(inFd, buf, len < 65536 ? len : 65536, inOff);
+        if (rd <= 0) {
+            if (rd < 0 && errno == EINTR) continue;
+            ret = -1;
+            break;
+        }
+        if (writeAll(outFd, buf, rd) != 0) {
+            ret = -1;
+            break;
+        }
+        inOff += rd;
+        len -= rd;
+    }
+    free(buf);
+    return ret;
+}
+
+/* With --trace=<file> (or MLIBTOOL_TRACE=<file>), mlibtool appends Chrome
+ * trace events (as loaded by chrome://tracing or Perfetto) for each phase of
+ * its work to <file>. Many mlibtools may share one file: it's created with
+ * its opening [ atomically, and each event is a single O_APPEND write. The
+ * closing ] is left off, as the trace format allows. */
+static int traceFd = -1;
+static pid_t tracePid = 0;
+static long long traceStart;
+
+/* a growing string for building trace events */
+struct TraceBuf {
+    char *s;
+    size_t len, sz;
+};
+
+/* Microseconds since the epoch, so every process's events line up */
+static long long traceNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* With --stats=<file> (or MLIBTOOL_STATS=<file>), mlibtool appends a line
+ * for each invocation to <file>, giving its own resource use, the time spent
+ * in each of the phases that would be traced, and the total resource use of
+ * the children it ran, as tab-separated name=value fields. mlibtool-stats
+ * summarizes them. */
+static int statsFd = -1;
+static pid_t statsPid = 0;
+static long long statsStart;
+static const char *statsMode = "", *statsOutput = "";
+static int statsFallback = 0;
+
+/* time spent in each phase, by trace category ("child" for children) */
+static const char *const statsPhaseNames[] = {
+    "child", "sanity", "probe", "read", "write", "cache", NULL
+};
+static long long statsPhases[6];
+
+/* the children's resource use */
+static int statsChildren = 0;
+static double statsChildUser = 0, statsChildSys = 0;
+static long statsChildMaxRss = 0, statsChildMajFlt = 0;
+
+static void traceAdd(struct TraceBuf *tb, const char *str, size_t len)
+{
+    char *s;
+    if (tb->len + len + 1 > tb->sz) {
+        size_t sz = tb->sz ? tb->sz : 256;
+        while (tb->len + len + 1 > sz) sz *= 2;
+        if (!(s = realloc(tb->s, sz))) return;
+        tb->s = s;
+        tb->sz = sz;
+    }
+    memcpy(tb->s + tb->len, str, len);
+    tb->len += len;
+    tb->s[tb->len] = '\0';
+}
+
+/* Add a string as a JSON string */
+static void traceAddStr(struct TraceBuf *tb, const char *str)
+{
+    char esc[8];
+    traceAdd(tb, "\"", 1);
+    for (; *str; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            traceAdd(tb, esc, 2);
+        } else if (c < 0x20) {
+            sprintf(esc, "\\u%04x", c);
+            traceAdd(tb, esc, 6);
+        } else {
+            traceAdd(tb, str, 1);
+        }
+    }
+    traceAdd(tb, "\"", 1);
+}
+
+/* Add a command as a JSON string of its words */
+static void traceAddCmd(struct TraceBuf *tb, char *const *cmd)
+{
+    struct TraceBuf words;
+    size_t i;
+
+    memset(&words, 0, sizeof(words));
+    for (i = 0; cmd[i]; i++) {
+        if (i) traceAdd(&words, " ", 1);
+        traceAdd(&words, cmd[i], strlen(cmd[i]));
+    }
+    traceAddStr(tb, words.s ? words.s : "");
+    free(words.s);
+}
+
+/* Record a span from start until now. args, if given, is the JSON for its
+ * args object (and is freed). */
+static void traceSpan(const char *cat, const char *name, long long start,
+                      struct TraceBuf *args)
+{
+    struct TraceBuf ev;
+    char nums[128];
+    long long now;
+
+    if (traceFd < 0 && statsFd < 0) return;
+    now = traceNow();
+
+    if (statsFd >= 0) {
+        int i;
+        for (i = 0; statsPhaseNames[i]; i++)
+            if (!strcmp(cat, statsPhaseNames[i]))
+                statsPhases[i] += now - start;
+    }
+    if (traceFd < 0) {
+        if (args) free(args->s);
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    traceAdd(&ev, "{\"name\":", 8);
+    traceAddStr(&ev, name);
+    traceAdd(&ev, ",\"cat\":", 7);
+    traceAddStr(&ev, cat);
+    sprintf(nums, ",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d",
+            start, now - start, (int) getpid(), (int) getpid());
+    traceAdd(&ev, nums, strlen(nums));
+    if (args && args->s) {
+        traceAdd(&ev, ",\"args\":{", 9);
+        traceAdd(&ev, args->s, args->len);
+        traceAdd(&ev, "}", 1);
+    }
+    traceAdd(&ev, "},\n", 3);
+
+    if (ev.s) {
+        if (write(traceFd, ev.s, ev.len) < 0) {}
+        free(ev.s);
+    }
+    if (args) free(args->s);
+}
+
+/* Record a span for a file, as its path */
+static void traceFile(const char *cat, const char *name, long long start,
+                      const char *path)
+{
+    struct TraceBuf args;
+    memset(&args, 0, sizeof(args));
+    traceAdd(&args, "\"path\":", 7);
+    traceAddStr(&args, path);
+    traceSpan(cat, name, start, &args);
+}
+
+/* children we're tracing, between starting and waiting for them */
+struct TraceChild {
+    pid_t pid;
+    long long start;
+    char *const *cmd;
+};
+static struct TraceChild *traceChildren = NULL;
+static size_t traceChildrenUsed = 0, traceChildrenSz = 0;
+
+static void traceChildStart(pid_t pid, char *const *cmd)
+{
+    struct TraceChild *tc;
+    if ((traceFd < 0 && statsFd < 0) || pid <= 0) return;
+    if (traceChildrenUsed >= traceChildrenSz) {
+        traceChildrenSz = traceChildrenSz ? traceChildrenSz * 2 : 8;
+        ORX(traceChildren, realloc, NULL, (traceChildren, traceChildrenSz * sizeof(*tc)));
+    }
+    tc = &traceChildren[traceChildrenUsed++];
+    tc->pid = pid;
+    tc->start = traceNow();
+    tc->cmd = cmd;
+}
+
+static void traceChildEnd(pid_t pid, int status, struct rusage *ru)
+{
+    struct TraceBuf args;
+    char nums[32];
+    size_t i;
+
+    for (i = 0; i < traceChildrenUsed; i++) {
+        struct TraceChild *tc = &traceChildren[i];
+        if (tc->pid != pid) continue;
+
+        statsChildren++;
+        statsChildUser += ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+        statsChildSys += ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+        if (ru->ru_maxrss > statsChildMaxRss)
+            statsChildMaxRss = ru->ru_maxrss;
+        statsChildMajFlt += ru->ru_majflt;
+
+        memset(&args, 0, sizeof(args));
+        traceAdd(&args, "\"argv\":", 7);
+        traceAddCmd(&args, tc->cmd);
+        sprintf(nums, ",\"status\":%d", status);
+        traceAdd(&args, nums, strlen(nums));
+        traceSpan("child", tc->cmd[0], tc->start, &args);
+
+        traceChildren[i] = traceChildren[--traceChildrenUsed];
+        return;
+    }
+}
+
+static char **traceArgv;
+
+/* Record the whole invocation, however it ends */
+static void traceExit(void)
+{
+    struct TraceBuf args;
+
+    if (traceFd < 0 || tracePid != getpid()) return;
+    memset(&args, 0, sizeof(args));
+    traceAdd(&args, "\"argv\":", 7);
+    traceAddCmd(&args, traceArgv);
+    traceSpan("mlibtool", "mlibtool", traceStart, &args);
+    close(traceFd);
+    traceFd = -1;
+}
+
+/* Write this invocation's stats, however it ends */
+static void statsExit(void)
+{
+    struct TraceBuf line;
+    struct rusage self;
+    char nums[512];
+    int i;
+
+    if (statsFd < 0 || statsPid != getpid()) return;
+    getrusage(RUSAGE_SELF, &self);
+
+    memset(&line, 0, sizeof(line));
+    sprintf(nums, "time=%.3f\tpid=%d\tmode=", statsStart / 1e6, (int) getpid());
+    traceAdd(&line, nums, strlen(nums));
+    traceAdd(&line, statsMode, strlen(statsMode));
+    traceAdd(&line, "\toutput=", 8);
+    traceAdd(&line, statsOutput, strlen(statsOutput));
+    sprintf(nums, "\tlibtool=%d\twall=%.6f\tuser=%.6f\tsys=%.6f\tmaxrss=%ld"
+                  "\tchildren=%d\tcuser=%.6f\tcsys=%.6f\tcmaxrss=%ld\tcmajflt=%ld",
+            statsFallback, (traceNow() - statsStart) / 1e6,
+            self.ru_utime.tv_sec + self.ru_utime.tv_usec / 1e6,
+            self.ru_stime.tv_sec + self.ru_stime.tv_usec / 1e6,
+            (long) self.ru_maxrss, statsChildren, statsChildUser, statsChildSys,
+            statsChildMaxRss, statsChildMajFlt);
+    traceAdd(&line, nums, strlen(nums));
+    for (i = 0; statsPhaseNames[i]; i++) {
+        sprintf(nums, "\t%s=%.6f", statsPhaseNames[i], statsPhases[i] / 1e6);
+        traceAdd(&line, nums, strlen(nums));
+    }
+    traceAdd(&line, "\n", 1);
+
+    if (line.s) {
+        if (write(statsFd, line.s, line.len) < 0) {}
+        free(line.s);
+    }
+    close(statsFd);
+    statsFd = -1;
+}
+
+/* Start recording stats to path, as of start */
+static void statsInit(const char *path, long long start)
+{
+    static int registered = 0;
+
+    if (statsFd >= 0) close(statsFd);
+    if ((statsFd = open(path, O_WRONLY|O_APPEND|O_CREAT, 0666)) < 0) {
+        perror(path);
+        return;
+    }
+    fcntl(statsFd, F_SETFD, FD_CLOEXEC);
+    statsPid = getpid();
+    statsStart = start;
+    if (!registered) {
+        atexit(statsExit);
+        registered = 1;
+    }
+}
+
+/* Start tracing to path, as of start */
+static void traceInit(const char *path, char **argv, long long start)
+{
+    static int registered = 0;
+    char *tmpName;
+    int fd;
+
+    if (traceFd >= 0) close(traceFd);
+    traceFd = -1;
+
+    /* make sure it exists and starts with [ */
+    if (access(path, F_OK) != 0) {
+        ORX(tmpName, malloc, NULL, (strlen(path) + 32));
+        sprintf(tmpName, "%s.%d", path, (int) getpid());
+        if ((fd = open(tmpName, O_WRONLY|O_CREAT|O_TRUNC, 0666)) >= 0) {
+            int ok = (writeAll(fd, "[\n", 2) == 0);
+            if (close(fd) == 0 && ok)
+                link(tmpName, path); /* unless someone beat us to it */
+            unlink(tmpName);
+        }
+        free(tmpName);
+    }
+
+    if ((traceFd = open(path, O_WRONLY|O_APPEND)) < 0) {
+        perror(path);
+        return;
+    }
+    fcntl(traceFd, F_SETFD, FD_CLOEXEC);
+    tracePid = getpid();
+    traceStart = start;
+    traceArgv = argv;
+    if (!registered) {
+        atexit(traceExit);
+        registered = 1;
+    }
+}
+
+/* Make a path absolute for use as a cache key (allocates) */
+static char *absPath(const char *path)
+{
+    static char *cwd = NULL;
+    char *ret;
+
+    if (path[0] == '/') {
+        ORX(ret, strdup, NULL, (path));
+        return ret;
+    }
+
+    if (!cwd) {
+        ORX(cwd, malloc, NULL, (4096));
+        if (!getcwd(cwd, 4096)) strcpy(cwd, ".");
+    }
+
+    ORX(ret, malloc, NULL, (strlen(cwd) + strlen(path) + 2));
+    sprintf(ret, "%s/%s", cwd, path);
+    return ret;
+}
+
+/* Find a program in $PATH (allocates) */
+static char *findProgram(const char *prog)
+{
+    const char *path, *part;
+    char *ret;
+
+    if (strchr(prog, '/'))
+        return absPath(prog);
+
+    path = getenv("PATH");
+    if (!path) path = "/bin:/usr/bin";
+
+    for (part = path; ; part++) {
+        const char *end = strchr(part, ':');
+        size_t len = end ? (size_t) (end - part) : strlen(part);
+
+        ORX(ret, malloc, NULL, (len + strlen(prog) + 3));
+        if (len) {
+            memcpy(ret, part, len);
+            ret[len] = '\0';
+        } else {
+            strcpy(ret, ".");
+        }
+        strcat(ret, "/");
+        strcat(ret, prog);
+        if (access(ret, X_OK) == 0)
+            return ret;
+        free(ret);
+
+        if (!end) break;
+        part = end;
+    }
+
+    return NULL;
+}
+
+/* Find (and create) mlibtool's directory under $XDG_CACHE_HOME (allocates).
+ * Returns NULL if there's no suitable directory. */
+static char *userCacheDir(void)
+{
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char *ret;
+
+    if (base && base[0] == '/') {
+        ORX(ret, malloc, NULL, (strlen(base) + 10));
+        sprintf(ret, "%s/mlibtool", base);
+
+    } else if (home && home[0] == '/') {
+        ORX(ret, malloc, NULL, (strlen(home) + 17));
+        sprintf(ret, "%s/.cache", home);
+        mkdir(ret, 0777);
+        strcat(ret, "/mlibtool");
+
+    } else {
+        return NULL;
+
+    }
+
+    if (mkdir(ret, 0777) != 0 && errno != EEXIST) {
+        free(ret);
+        return NULL;
+    }
+    return ret;
+}
+
+/* How many arguments starting at argv[i] are a flag that changes the
+ * compiler's target? */
+static int targetFlag(char **argv, int i)
+{
+    char *arg = argv[i];
+
+    if (!strcmp(arg, "-m16") || !strcmp(arg, "-m31") ||
+        !strcmp(arg, "-m32") || !strcmp(arg, "-m64") ||
+        !strcmp(arg, "-mx32") ||
+        !strncmp(arg, "-mabi=", 6) ||
+        !strncmp(arg, "--target=", 9) ||
+        !strncmp(arg, "--sysroot=", 10))
+        return 1;
+
+    if ((!strcmp(arg, "-target") || !strcmp(arg, "--sysroot") ||
+         !strcmp(arg, "-b")) && argv[i+1])
+        return 2;
+
+    return 0;
+}
+
+/* Describe a compiler for caching: its resolved path, mtime and size, and any
+ * flags in argv that change its target. Also gets the resolved path and its
+ * stat for validating cache entries. Returns NULL if the compiler can't be
+ * found (allocates) */
+static char *compilerIdentity(char *cc, char **argv, char **ccPath, struct stat *sb)
+{
+    char *found, *ret;
+    size_t len;
+    int i, j, n;
+
+    *ccPath = NULL;
+    if (!(found = findProgram(cc))) return NULL;
+    *ccPath = realpath(found, NULL);
+    free(found);
+    if (!*ccPath) return NULL;
+    if (stat(*ccPath, sb) != 0) {
+        free(*ccPath);
+        *ccPath = NULL;
+        return NULL;
+    }
+
+    len = strlen(*ccPath) + 64;
+    for (i = 1; argv[i]; i++)
+        len += strlen(argv[i]) + 1;
+
+    ORX(ret, malloc, NULL, (len));
+    sprintf(ret, "%s %lld %lld", *ccPath, (long long) sb->st_mtime,
+            (long long) sb->st_size);
+    for (i = 1; argv[i]; i += (n ? n : 1)) {
+        n = targetFlag(argv, i);
+        for (j = 0; j < n; j++) {
+            strcat(ret, " ");
+            strcat(ret, argv[i+j]);
+        }
+    }
+
+    return ret;
+}
 
-/* Generate a filename to cache sanity (allocates) */
-static char *cachedSanityName(char *cc, char **argv)
+/* Generate a filename to cache sanity (allocates). If we know the compiler's
+ * identity, the cache is in the user's cache directory and shared by every
+ * build, otherwise it's in the output directory. */
+static char *cachedSanityName(char *cc, char *ident, char **argv)
 {
     int i;
     char *repr = NULL;
     char *dirC, *dir, *ret;
 
+    if (ident && (dir = userCacheDir())) {
+        ORX(ret, malloc, NULL, (strlen(dir) + 23));
+        sprintf(ret, "%s/sane-%016llx", dir, hashStr(ident));
+        free(dir);
+        return ret;
+    }
+
+    /* otherwise, we need a simple filename */
+    if (strchr(cc, '/')) return NULL;
+
     for (i = 0; argv[i]; i++) {
         char *ext;
         if (!strcmp(argv[i], "-o") && argv[i+1]) {
@@ -171,89 +971,153 @@ static char *cachedSanityName(char *cc, char **argv)
     return ret;
 }
 
-/* Cache the sanity of this system if possible */
-static void systemCacheSanity(char *cc, char **argv, int sane)
+/* pic is -1 if we know the system is sane, but not whether it's PIC */
+#define SANITY_STR(sane, pic) \
+    ((sane) ? ((pic) > 0 ? "1p" : (pic) < 0 ? "1?" : "1") : "0")
+
+/* Cache the sanity of this system if possible, along with whether the
+ * compiler generates PIC by default. Shared caches also hold the compiler
+ * identity, to detect hash collisions. */
+static void systemCacheSanity(char *cc, char *ident, char **argv, int sane, int pic)
 {
     FILE *f;
-    char *cacheName = cachedSanityName(cc, argv);
+    char *cacheName = cachedSanityName(cc, ident, argv);
+    char *tmpName;
     if (!cacheName) return;
-    if (access(cacheName, F_OK) == 0) {
+
+    if (!ident) {
+        if (access(cacheName, F_OK) == 0) {
+            free(cacheName);
+            return;
+        }
+        f = fopen(cacheName, "w");
+        if (f) {
+            fputs(SANITY_STR(sane, pic), f);
+            fclose(f);
+        }
         free(cacheName);
         return;
     }
-    f = fopen(cacheName, "w");
+
+    /* parallel builds share this, so write it atomically */
+    ORX(tmpName, malloc, NULL, (strlen(cacheName) + 4*sizeof(int) + 2));
+    sprintf(tmpName, "%s.%d", cacheName, (int) getpid());
+    f = fopen(tmpName, "w");
     if (f) {
-        fwrite(sane ? "1" : "0", 1, 1, f);
-        fclose(f);
+        fprintf(f, "%s\n%s\n", SANITY_STR(sane, pic), ident);
+        if (fclose(f) == 0 && rename(tmpName, cacheName) == 0) {
+            free(tmpName);
+            free(cacheName);
+            return;
+        }
+        unlink(tmpName);
     }
+    free(tmpName);
     free(cacheName);
 }
 
-/* Check the cache for system sanity */
-static int systemCachedSanity(char *cc, char **argv)
+/* Check the cache for system sanity. Sets *pic to -1 if the cache doesn't say
+ * whether the compiler generates PIC. */
+static int systemCachedSanity(char *cc, char *ident, char **argv, int *pic)
 {
     FILE *f;
     int cs = -1;
-    char *cacheName = cachedSanityName(cc, argv);
+    char *cacheName = cachedSanityName(cc, ident, argv);
     if (!cacheName) return -1;
     f = fopen(cacheName, "r");
     if (f) {
         cs = fgetc(f);
         if (cs == EOF) cs = -1;
         else cs -= '0';
+        if (cs == 1) {
+            int c = fgetc(f);
+            if (c == 'p') *pic = 1;
+            else if (c == '?') *pic = -1;
+            else if (c != EOF) ungetc(c, f); /* the end of the line */
+        }
+
+        if (ident && cs != -1) {
+            /* make sure it's really this compiler */
+            char *line;
+            size_t len = strlen(ident) + 2;
+            int c;
+            while ((c = fgetc(f)) != EOF && c != '\n');
+            ORX(line, malloc, NULL, (len + 1));
+            if (!fgets(line, len + 1, f) || strncmp(line, ident, len - 2) ||
+                strcmp(line + len - 2, "\n")) {
+                cs = -1;
+                *pic = 0;
+            }
+            free(line);
+        }
         fclose(f);
     }
     free(cacheName);
     return cs;
 }
 
-/* Is this system sane? */
-static int systemIsSane(char *cc, char **argv)
+/* Is this system sane? Also sets *pic if the compiler generates PIC by
+ * default. The preprocessor is run with any flags in argv that change its
+ * target. Returns -1 if we couldn't ask it. */
+static int systemProbeSanity(struct Options *opt, char *cc, char **argv,
+                             int *pic)
 {
     pid_t pid;
     int pipei[2], pipeo[2];
-    int tmpi, sane, insane = 0;
+    int tmpi, sane, failed = 0;
     size_t i, bufused;
     ssize_t rd;
-    int slashes = 1;
 #define BUFSZ 32
     char buf[BUFSZ];
+    char **ppCmd;
+    int j, n, ppc;
 
     /* We determine if it's sane by asking the preprocessor */
     static const char *sanityCheck =
         "#if " SANE "\n"
         "SYSTEM_IS_SANE\n"
+        "#endif\n"
+        "#ifdef __PIC__\n"
+        "SYSTEM_IS_PIC\n"
         "#endif";
 
-    /* we can cache sanity if we can make a simple filename */
-    if (strchr(cc, '/') == NULL) {
-        int cachedSanity = systemCachedSanity(cc, argv);
-        if (cachedSanity != -1) return cachedSanity;
-        slashes = 0;
-    }
+    *pic = 0;
 
     ORX(tmpi, pipe, -1, (pipei));
     ORX(tmpi, pipe, -1, (pipeo));
-    ORX(pid, fork, -1, ());
-    if (pid == 0) {
-        /* child process, read in preproc commands */
-        ORX(tmpi, dup2, -1, (pipei[0], 0));
-        close(pipei[0]); close(pipei[1]);
-        ORX(tmpi, dup2, -1, (pipeo[1], 1));
-        close(pipeo[0]); close(pipeo[1]);
-
-        /* and spawn the preprocessor */
-        execlp(cc, cc, "-E", "-", NULL);
-        perror(cc);
-        exit(1);
+    for (i = 0; i < 2; i++) {
+        fcntl(pipei[i], F_SETFD, FD_CLOEXEC);
+        fcntl(pipeo[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    /* spawn the preprocessor, reading our commands */
+    for (j = 0; argv[j]; j++);
+    ORX(ppCmd, malloc, NULL, ((j + 4) * sizeof(char *)));
+    ppc = 0;
+    ppCmd[ppc++] = cc;
+    for (j = 1; argv[j]; j += (n ? n : 1)) {
+        n = targetFlag(argv, j);
+        for (i = 0; i < (size_t) n; i++)
+            ppCmd[ppc++] = argv[j+i];
     }
+    ppCmd[ppc++] = "-E";
+    ppCmd[ppc++] = "-";
+    ppCmd[ppc] = NULL;
+    pid = launch(opt, ppCmd, pipei[0], pipeo[1]);
+    free(ppCmd);
     close(pipei[0]);
     close(pipeo[1]);
+    if (pid < 0) {
+        perror(cc);
+        close(pipei[1]);
+        close(pipeo[0]);
+        return -1;
+    }
 
     /* now send it the check */
     i = strlen(sanityCheck);
     if (write(pipei[1], sanityCheck, i) != i)
-        insane = 1;
+        failed = 1;
     close(pipei[1]);
 
     /* and read its input */
@@ -266,6 +1130,8 @@ static int systemIsSane(char *cc, char **argv)
 
         if (!strncmp(buf, "SYSTEM_IS_SANE", 14))
             sane = 1;
+        else if (!strncmp(buf, "SYSTEM_IS_PIC", 13))
+            *pic = 1;
 
         for (i = 0; i < bufused && buf[i] != '\n'; i++);
         if (i < bufused) i++;
@@ -275,93 +1141,801 @@ static int systemIsSane(char *cc, char **argv)
     close(pipeo[0]);
 
     /* then wait for it */
-    if (waitpid(pid, &tmpi, 0) != pid)
-        insane = 1;
-    if (tmpi != 0)
-        insane = 1;
+    if (waitpid(pid, &tmpi, 0) != pid || tmpi != 0)
+        failed = 1;
 
     /* finished */
-    if (insane) sane = 0;
-
-    /* cache it */
-    if (!slashes)
-        systemCacheSanity(cc, argv, sane);
+    if (failed) {
+        *pic = 0;
+        return -1;
+    }
+    if (!sane) *pic = 0;
 
     return sane;
 }
 
+/* Is this system sane? Like systemProbeSanity, but cached in a server's
+ * memory or on disk when possible, and a failed probe is taken as insane. If
+ * probe is 0, returns -1 instead of probing. */
+static int systemIsSane(struct Options *opt, char *cc, char **argv, int *pic,
+                        int probe)
+{
+    char *ident, *ccPath, *key = NULL;
+    const char *cached = NULL;
+    struct stat sb;
+    int sane, picBuf = 0;
+    int probePic = probe && pic;
+
+    if (!pic) pic = &picBuf;
+    *pic = 0;
+
+    ident = compilerIdentity(cc, argv, &ccPath, &sb);
+
+    /* a server may already know */
+    if (ident && MEM_CACHE_ACTIVE()) {
+        ORX(key, malloc, NULL, (strlen(ident) + 6));
+        sprintf(key, "sane:%s", ident);
+        cached = memCacheGet(key);
+    }
 
-/* our modes */
-enum Mode {
-    MODE_UNKNOWN = 0,
-    MODE_COMPILE,
-    MODE_LINK,
-    MODE_INSTALL
-};
+    if (cached) {
+        sane = (cached[0] == '1');
+        if (sane && cached[1] == 'p') *pic = 1;
+        else if (sane && cached[1] == '?') *pic = -1;
+    }
 
-/* options necessary to handle modes */
-struct Options {
-    int dryRun, quiet, retryIfFail;
-    int buildShared, buildStatic; /* also effects -fPIC in .o files */
+    if (!cached || (*pic == -1 && probePic)) {
+        /* we may have cached it on disk */
+        if (!cached)
+            sane = systemCachedSanity(cc, ident, argv, pic);
+
+        /* if we only know it's sane, probe to find out about PIC */
+        if (*pic == -1 && probePic)
+            sane = -1;
+
+        if (sane == -1 && probe) {
+            long long start = traceNow();
+            sane = systemProbeSanity(opt, cc, argv, pic);
+            traceSpan("probe", "probe", start, NULL);
+
+            /* if we couldn't ask, don't trust it this time, but don't
+             * remember it either */
+            if (sane == -1) {
+                free(key);
+                free(ccPath);
+                free(ident);
+                return 0;
+            }
+            systemCacheSanity(cc, ident, argv, sane, *pic);
+        }
+
+        if (key && sane != -1)
+            memCachePut(key, ccPath, &sb, SANITY_STR(sane, *pic));
+
+    }
+
+    /* without probing, assume it isn't PIC */
+    if (*pic == -1) *pic = 0;
+
+    free(key);
+    free(ccPath);
+    free(ident);
+    return sane;
+}
+
+/* Record that this system is sane, when we've found it out some other way
+ * than probing, leaving whether it's PIC unknown. Per-directory caches are
+ * never rewritten, so we only record it where the compiler is known. */
+static void systemRecordSanity(char *cc, char **argv)
+{
+    char *ident, *ccPath, *key;
+    struct stat sb;
+
+    ident = compilerIdentity(cc, argv, &ccPath, &sb);
+    if (!ident) {
+        free(ccPath);
+        return;
+    }
+    systemCacheSanity(cc, ident, argv, 1, -1);
+
+    if (MEM_CACHE_ACTIVE()) {
+        ORX(key, malloc, NULL, (strlen(ident) + 6));
+        sprintf(key, "sane:%s", ident);
+        memCachePut(key, ccPath, &sb, SANITY_STR(1, -1));
+        free(key);
+    }
+
+    free(ccPath);
+    free(ident);
+}
+
+/* The header forced into optimistic compiles, which fails on insane
+ * systems */
+#define SANE_CHECK_HEADER "#if !(" SANE ")\n" \
+                          "#error \"mlibtool: unsupported target, retrying with libtool\"\n" \
+                          "#endif\n"
+
+/* Find (and create if needed) the sanity check header (allocates). Returns
+ * NULL if there's nowhere to put it. */
+static char *sanityCheckHeader(void)
+{
+    char *dir, *ret, *tmpName;
+    FILE *f;
+
+    if (!(dir = userCacheDir())) return NULL;
+    ORX(ret, malloc, NULL, (strlen(dir) + strlen(MLIBTOOL_VERSION) + 16));
+    sprintf(ret, "%s/sane-check-%s.h", dir, MLIBTOOL_VERSION);
+    free(dir);
+    if (access(ret, R_OK) == 0) return ret;
+
+    /* make it atomically, since other jobs may be using it */
+    ORX(tmpName, malloc, NULL, (strlen(ret) + 4*sizeof(int) + 2));
+    sprintf(tmpName, "%s.%d", ret, (int) getpid());
+    f = fopen(tmpName, "w");
+    if (f) {
+        fputs(SANE_CHECK_HEADER, f);
+        if (fclose(f) == 0 && rename(tmpName, ret) == 0) {
+            free(tmpName);
+            return ret;
+        }
+        unlink(tmpName);
+    }
+    free(tmpName);
+    free(ret);
+    return NULL;
+}
 
-    int arglt; /* where the libtool command starts */
-    int argc;
-    char **argv, **cmd;
-};
 
-/* redirect to libtool */
-static void execLibtool(struct Options *opt)
+/* Write a field of the fallback log, without tabs or newlines */
+static void fallbackLogField(struct TraceBuf *tb, const char *name,
+                             const char *val)
+{
+    const char *c;
+
+    traceAdd(tb, "\t", 1);
+    traceAdd(tb, name, strlen(name));
+    traceAdd(tb, "=", 1);
+    for (c = val; *c; c++)
+        traceAdd(tb, (*c == '\t' || *c == '\n') ? " " : c, 1);
+}
+
+/* Redirect to libtool, because of reason. With --fallback-log=<file> (or
+ * MLIBTOOL_FALLBACK_LOG=<file>), run libtool as a child instead, and append a
+ * line to <file> saying why, where, and how long it took. */
+static void execLibtool(struct Options *opt, const char *reason, ...)
 {
     int arglt = opt->arglt;
     char **argv = opt->argv;
+    char why[512], cwd[4096], nums[128];
+    struct TraceBuf line;
+    struct rusage ru;
+    long long start;
+    va_list ap;
+    pid_t pid;
+    int fd, status;
+
+    va_start(ap, reason);
+    vsnprintf(why, sizeof(why), reason, ap);
+    va_end(ap);
 
     if (!opt->quiet)
-        fprintf(stderr, "mlibtool: unsupported configuration, trying libtool (%s)\n", argv[arglt]);
+        fprintf(stderr, "mlibtool: unsupported configuration (%s), trying libtool (%s)\n",
+                why, argv[arglt]);
+    statsFallback = 1;
+
+    if (!opt->fallbackLog) {
+        /* we won't get to exit */
+        statsExit();
+        traceExit();
+        execvp(argv[arglt], argv + arglt);
+        perror(argv[arglt]);
+        exit(1);
+    }
 
-    execvp(argv[arglt], argv + arglt);
-    perror(argv[arglt]);
-    exit(1);
+    /* run it as a child so we can time it */
+    start = traceNow();
+    pid = launch(opt, argv + arglt, -1, -1);
+    if (pid < 0) {
+        perror(argv[arglt]);
+        exit(1);
+    }
+    traceChildStart(pid, argv + arglt);
+    while (wait4(pid, &status, 0, &ru) != pid) {
+        if (errno != EINTR) {
+            perror(argv[arglt]);
+            exit(1);
+        }
+    }
+    traceChildEnd(pid, status, &ru);
+
+    /* then log it */
+    if (!getcwd(cwd, sizeof(cwd))) strcpy(cwd, "?");
+    memset(&line, 0, sizeof(line));
+    sprintf(nums, "time=%.3f\tpid=%d", start / 1e6, (int) getpid());
+    traceAdd(&line, nums, strlen(nums));
+    fallbackLogField(&line, "mode", statsMode);
+    fallbackLogField(&line, "output", statsOutput);
+    fallbackLogField(&line, "reason", why);
+    fallbackLogField(&line, "cwd", cwd);
+    sprintf(nums, "\tstatus=%d\twall=%.6f",
+            WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+            (traceNow() - start) / 1e6);
+    traceAdd(&line, nums, strlen(nums));
+    traceAdd(&line, "\n", 1);
+
+    fd = open(opt->fallbackLog, O_WRONLY|O_APPEND|O_CREAT, 0666);
+    if (fd < 0) {
+        perror(opt->fallbackLog);
+    } else {
+        if (write(fd, line.s, line.len) < 0) {}
+        close(fd);
+    }
+    free(line.s);
+
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
 }
 
-/* Generic function to spawn a child and wait for it, exiting if the child
- * fails. */
-static void spawn(struct Options *opt, char *const *cmd)
+/* Allocate from the invocation's arena. Everything allocated this way lives
+ * until arenaFree. */
+static void *arenaAlloc(struct Options *opt, size_t sz)
+{
+    struct ArenaBlock *block = opt->arena;
+    void *ret;
+
+    sz = (sz + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    if (!block || block->sz - block->used < sz) {
+        /* need a new block, big enough for this at least */
+        size_t bsz = ARENA_BLOCK_SZ;
+        if (bsz < sz) bsz = sz;
+        ORL(block, malloc, NULL, (sizeof(struct ArenaBlock) + bsz));
+        block->next = opt->arena;
+        block->used = 0;
+        block->sz = bsz;
+        opt->arena = block;
+    }
+
+    ret = (char *) (block + 1) + block->used;
+    block->used += sz;
+    return ret;
+}
+
+/* Free the whole arena */
+static void arenaFree(struct Options *opt)
+{
+    struct ArenaBlock *block, *next;
+    for (block = opt->arena; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    opt->arena = NULL;
+}
+
+/* strdup into the arena */
+static char *arenaStrdup(struct Options *opt, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    return memcpy(arenaAlloc(opt, len), str, len);
+}
+
+/* sprintf into the arena */
+static char *arenaPrintf(struct Options *opt, const char *fmt, ...)
+{
+    va_list ap;
+    char *ret;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        perror("mlibtool: vsnprintf");
+        execLibtool(opt, "vsnprintf failed");
+    }
+
+    ret = arenaAlloc(opt, len + 1);
+    va_start(ap, fmt);
+    vsnprintf(ret, len + 1, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+/* dirname into the arena */
+static char *arenaDirname(struct Options *opt, const char *path)
+{
+    return dirname(arenaStrdup(opt, path));
+}
+
+/* basename into the arena, without its extension if stripExt is set */
+static char *arenaBasename(struct Options *opt, const char *path, int stripExt)
+{
+    char *ret = basename(arenaStrdup(opt, path));
+    char *ext;
+    if (stripExt && (ext = strrchr(ret, '.')))
+        *ext = '\0';
+    return ret;
+}
+
+/* The name of a file in a directory's .libs, e.g. dir/.libs/base.ext (ext
+ * may be empty) */
+static char *arenaLibsPath(struct Options *opt, const char *dir,
+                           const char *base, const char *ext)
+{
+    return arenaPrintf(opt, "%s/.libs/%s%s", dir, base, ext);
+}
+
+/* realpath into the arena, or NULL */
+static char *arenaRealpath(struct Options *opt, const char *path)
+{
+    char *real = realpath(path, NULL), *ret;
+    if (!real) return NULL;
+    ret = arenaStrdup(opt, real);
+    free(real);
+    return ret;
+}
+
+/* The path of directory to relative to directory from, both canonical, as an
+ * rpath entry, e.g. $ORIGIN/../lib/.libs */
+static char *arenaOriginPath(struct Options *opt, const char *from,
+                             const char *to)
+{
+    size_t i, common = 0, ups = 0;
+    char *ret;
+
+    if (!strcmp(from, "/")) from = "";
+    if (!strcmp(to, "/")) to = "";
+
+    /* find the last directory they have in common */
+    for (i = 0;; i++) {
+        if ((from[i] == '/' || !from[i]) && (to[i] == '/' || !to[i]))
+            common = i;
+        if (!from[i] || from[i] != to[i]) break;
+    }
+
+    /* then go up from from to there, and down to to */
+    for (i = common; from[i]; i++)
+        if (from[i] == '/') ups++;
+    ret = arenaAlloc(opt, sizeof("$ORIGIN") + 3 * ups + strlen(to + common));
+    strcpy(ret, "$ORIGIN");
+    for (i = 0; i < ups; i++)
+        strcat(ret, "/..");
+    strcat(ret, to + common);
+    return ret;
+}
+
+/* Print a command we're about to run */
+static void printCmd(struct Options *opt, char *const *cmd)
 {
     size_t i;
-    int fail = 0;
 
-    /* output the command */
     if (!opt->quiet) {
         fprintf(stderr, "mlibtool:");
         for (i = 0; cmd[i]; i++)
             fprintf(stderr, " %s", cmd[i]);
         fprintf(stderr, "\n");
     }
+}
+
+/* Start a child without waiting for it. Returns 0 in dry-run mode, or -1 if
+ * the child couldn't be started. */
+static pid_t spawnStart(struct Options *opt, char *const *cmd)
+{
+    pid_t pid = 0;
+
+    /* output the command */
+    printCmd(opt, cmd);
 
     /* and run it */
     if (!opt->dryRun) {
-        pid_t pid;
-        int tmpi;
-        ORL(pid, fork, -1, ());
-        if (pid == 0) {
-            execvp(cmd[0], cmd);
+        pid = launch(opt, cmd, -1, -1);
+        if (pid < 0)
             perror(cmd[0]);
-            exit(1);
+        traceChildStart(pid, cmd);
+    }
+
+    return pid;
+}
+
+static int systemIsSane(struct Options *opt, char *cc, char **argv, int *pic,
+                        int probe);
+
+/* Handle a failed child, either by retrying with libtool or by exiting */
+static void spawnFailed(struct Options *opt)
+{
+    /* an optimistic compile may have failed because we're insane */
+    if (opt->checkSanity) {
+        opt->checkSanity = 0;
+        if (!systemIsSane(opt, opt->cmd[0], opt->cmd, NULL, 1))
+            execLibtool(opt, "%s failed the sanity check", opt->cmd[0]);
+    }
+
+    if (opt->retryIfFail) {
+        execLibtool(opt, "%s failed with -Wl,--whole-archive", opt->cmd[0]);
+    } else {
+        exit(1);
+    }
+}
+
+/* Wait for a child started by spawnStart. Returns 1 if it failed. */
+static int spawnWait(pid_t pid, char *const *cmd)
+{
+    struct rusage ru;
+    int tmpi;
+
+    if (pid == 0) return 0;
+    if (pid < 0) return 1;
+
+    if (wait4(pid, &tmpi, 0, &ru) != pid) {
+        perror(cmd[0]);
+        return 1;
+    }
+    traceChildEnd(pid, tmpi, &ru);
+
+    return (tmpi != 0);
+}
+
+/* Generic function to spawn a child and wait for it, exiting if the child
+ * fails. */
+static void spawn(struct Options *opt, char *const *cmd)
+{
+    if (spawnWait(spawnStart(opt, cmd), cmd))
+        spawnFailed(opt);
+}
+
+/* Under make -j, GNU make's jobserver hands out a token for each job beyond
+ * the first. mlibtool takes one for each child it runs beyond the first, and
+ * gives it back when the child is done, so its own parallelism fits within
+ * make's. Tokens are only ever taken without waiting: if there's none to be
+ * had, we wait for one of our own children instead. */
+static int jobserverRead = -1, jobserverWrite = -1;
+static int jobserverChecked = 0;
+
+#define JOB_NO_TOKEN 256 /* run without a token (there's no jobserver) */
+#define JOB_OWN_TOKEN 257 /* run on the token make gave us */
+
+/* Find the jobserver in MAKEFLAGS, if there is one */
+static void jobserverInit(void)
+{
+    char *flags = getenv("MAKEFLAGS"), *auth = NULL, *word, *end;
+    char path[64];
+    int rfd, wfd;
+
+    if (jobserverChecked) return;
+    jobserverChecked = 1;
+    if (!flags) return;
+
+    /* the last of --jobserver-auth (or the older --jobserver-fds) counts */
+    ORX(flags, strdup, NULL, (flags));
+    for (word = flags; word; word = end) {
+        if ((end = strchr(word, ' '))) *end++ = '\0';
+        if (!strcmp(word, "--")) break;
+        if (!strncmp(word, "--jobserver-auth=", 17))
+            auth = word + 17;
+        else if (!strncmp(word, "--jobserver-fds=", 16))
+            auth = word + 16;
+    }
+
+    if (!auth) {
+        /* no jobserver */
+
+    } else if (!strncmp(auth, "fifo:", 5)) {
+        if ((jobserverRead = open(auth + 5, O_RDWR|O_NONBLOCK)) >= 0) {
+            fcntl(jobserverRead, F_SETFD, FD_CLOEXEC);
+            jobserverWrite = jobserverRead;
+        }
+
+    } else if (sscanf(auth, "%d,%d", &rfd, &wfd) == 2 && !inServerWorker &&
+               fcntl(rfd, F_GETFD) != -1 && fcntl(wfd, F_GETFD) != -1) {
+        /* the pipe is shared with make, so it mustn't be made non-blocking;
+         * read it through a descriptor of our own instead (a server worker
+         * has the server's descriptors, not the client's, so can't) */
+        sprintf(path, "/proc/self/fd/%d", rfd);
+        if ((jobserverRead = open(path, O_RDONLY|O_NONBLOCK)) >= 0) {
+            fcntl(jobserverRead, F_SETFD, FD_CLOEXEC);
+            jobserverWrite = wfd;
+        }
+
+    }
+
+    free(flags);
+}
+
+/* Take a token to run another child alongside those already running.
+ * Returns the token, JOB_NO_TOKEN if there's no jobserver, or -1 if there's
+ * no token to be had right now. */
+static int jobTokenTake(void)
+{
+    unsigned char token;
+    ssize_t rd;
+
+    if (jobserverRead < 0) return JOB_NO_TOKEN;
+    while ((rd = read(jobserverRead, &token, 1)) < 0 && errno == EINTR);
+    return (rd == 1) ? token : -1;
+}
+
+/* Give back a token from jobTokenTake */
+static void jobTokenGive(int token)
+{
+    unsigned char c = token;
+    if (token < 0 || token >= JOB_NO_TOKEN) return;
+    while (write(jobserverWrite, &c, 1) < 0 && errno == EINTR);
+}
+
+/* Wait for any one of these children (those with pids > 0), without reaping
+ * any others we may have. Returns its pid, or -1 on error. */
+static pid_t waitAnyOf(const pid_t *pids, size_t count, int *status,
+                       struct rusage *ru)
+{
+    siginfo_t info;
+    size_t i, first = count;
+
+    for (i = 0; i < count; i++)
+        if (pids[i] > 0 && first == count) first = i;
+    if (first == count) return -1;
+
+    /* see who's finished, without reaping them */
+    memset(&info, 0, sizeof(info));
+    while (waitid(P_ALL, 0, &info, WEXITED|WNOWAIT) != 0)
+        if (errno != EINTR) return -1;
+    for (i = 0; i < count; i++)
+        if (pids[i] > 0 && pids[i] == info.si_pid)
+            return wait4(pids[i], status, 0, ru);
+
+    /* it's someone else's, so leave it and wait for one of ours */
+    return wait4(pids[first], status, 0, ru);
+}
+
+/* Spawn several independent children, running at most opt->maxJobs of them
+ * at once (and under make, as many as it has tokens for), and wait for all of
+ * them. Fails like spawn if any child fails, but only after every child that
+ * was started has been waited for. */
+static void spawnParallel(struct Options *opt, char *const **cmds, size_t count)
+{
+    pid_t *pids;
+    int *tokens;
+    size_t started = 0, running = 0, i;
+    int fail = 0, ownToken = 1;
+
+    if (count == 0) return;
+    ORL(pids, calloc, NULL, (count, sizeof(pid_t)));
+    ORL(tokens, calloc, NULL, (count, sizeof(int)));
+
+    while (started < count || running) {
+        /* start as many as we're allowed */
+        while (!fail && started < count && running < (size_t) opt->maxJobs) {
+            if (ownToken) {
+                tokens[started] = JOB_OWN_TOKEN;
+                ownToken = 0;
+            } else if ((tokens[started] = jobTokenTake()) < 0) {
+                break;
+            }
+
+            pids[started] = spawnStart(opt, cmds[started]);
+            if (pids[started] > 0) {
+                running++;
+            } else {
+                if (pids[started] < 0)
+                    fail = 1;
+                if (tokens[started] == JOB_OWN_TOKEN)
+                    ownToken = 1;
+                jobTokenGive(tokens[started]);
+            }
+            started++;
+        }
+        if (fail) count = started;
+
+        /* then wait for one to finish */
+        if (running) {
+            struct rusage ru;
+            pid_t pid;
+            int tmpi;
+
+            pid = waitAnyOf(pids, started, &tmpi, &ru);
+            if (pid == -1) {
+                perror("mlibtool: wait4");
+                fail = 1;
+                break;
+            }
+
+            traceChildEnd(pid, tmpi, &ru);
+            for (i = 0; i < started; i++) {
+                if (pids[i] == pid) {
+                    pids[i] = 0;
+                    running--;
+                    if (tokens[i] == JOB_OWN_TOKEN)
+                        ownToken = 1;
+                    jobTokenGive(tokens[i]);
+                    if (tmpi != 0) fail = 1;
+                    break;
+                }
+            }
         }
-        if (waitpid(pid, &tmpi, 0) != pid) {
-            perror(cmd[0]);
-            fail = 1;
-        } else if (tmpi != 0)
-            fail = 1;
     }
 
-    if (fail) {
-        if (opt->retryIfFail) {
-            execLibtool(opt);
+    /* if we lost track of any, their tokens can't stay lost */
+    for (i = 0; i < started; i++)
+        if (pids[i] > 0)
+            jobTokenGive(tokens[i]);
+
+    free(tokens);
+    free(pids);
+
+    if (fail)
+        spawnFailed(opt);
+}
+
+/* Would the PIC and non-PIC compiles of this command write the same files
+ * besides their objects, so that they can't run together? A dependency file
+ * named by -MF doesn't count, as the non-PIC one can be moved aside: the
+ * position of the -MF is put in *mfPos, or 0 if there's none. */
+static int compileSideOutputs(char *const *cmd, size_t *mfPos)
+{
+    size_t i;
+
+    *mfPos = 0;
+    for (i = 1; cmd[i]; i++) {
+        const char *arg = cmd[i];
+        if (!strncmp(arg, "-MF", 3)) {
+            if (!arg[3] && !cmd[i+1]) break;
+            *mfPos = i;
+            if (!arg[3]) i++;
+
+        } else if (!strncmp(arg, "-save-temps", 11) ||
+                   !strcmp(arg, "--coverage") ||
+                   !strcmp(arg, "-ftest-coverage") ||
+                   !strncmp(arg, "-fdump-", 7) ||
+                   !strncmp(arg, "-fstack-usage", 13) ||
+                   !strncmp(arg, "-fcallgraph-info", 16) ||
+                   !strcmp(arg, "-aux-info") ||
+                   !strcmp(arg, "-gsplit-dwarf") ||
+                   !strncmp(arg, "-Wp,", 4) ||
+                   !strcmp(arg, "-Xpreprocessor")) {
+            return 1;
+
+        }
+    }
+    return 0;
+}
+
+/* Does this flag change whether the compiler generates PIC? */
+static int isPicFlag(const char *arg)
+{
+    if (!strncmp(arg, "-fno-", 5))
+        arg += 5;
+    else if (!strncmp(arg, "-f", 2))
+        arg += 2;
+    else
+        return !strcmp(arg, "-mdynamic-no-pic");
+
+    return (!strcmp(arg, "pic") || !strcmp(arg, "PIC") ||
+            !strcmp(arg, "pie") || !strcmp(arg, "PIE"));
+}
+
+/* Is this the extension of a source file that's preprocessed as C (and so
+ * can have a header forced into it)? */
+static int isPreprocessedExt(const char *ext)
+{
+    static const char *exts[] = {
+        "c", "cc", "cp", "cpp", "cxx", "c++", "C", "CPP", "m", "mm", "M",
+        "S", "sx", NULL
+    };
+    size_t i;
+
+    for (i = 0; exts[i]; i++)
+        if (!strcmp(ext, exts[i])) return 1;
+    return 0;
+}
+
+/* a .lo or .la file, read in one go. Variables are kept as alternating name
+ * and value pointers into buf. */
+struct LtFile {
+    char *buf;
+    int sane; /* starts with SANE_HEADER */
+    struct Buffer vars;
+};
+
+/* Parse a shell-quoted value in place, returning the end of the line */
+static char *ltFileValue(char *in)
+{
+    char *out = in;
+    char quote = 0;
+
+    for (; *in && *in != '\n'; in++) {
+        if (quote == '\'') {
+            if (*in == '\'') quote = 0;
+            else *out++ = *in;
+        } else if (quote == '"') {
+            if (*in == '"') quote = 0;
+            else if (*in == '\\' && in[1] && in[1] != '\n') *out++ = *++in;
+            else *out++ = *in;
+        } else if (*in == '\'' || *in == '"') {
+            quote = *in;
+        } else if (*in == '\\' && in[1] && in[1] != '\n') {
+            *out++ = *++in;
+        } else if (*in == ' ' || *in == '\t') {
+            break;
         } else {
-            exit(1);
+            *out++ = *in;
+        }
+    }
+
+    /* skip anything else on the line */
+    while (*in && *in != '\n') in++;
+    if (*in) in++;
+    *out = '\0';
+    return in;
+}
+
+/* Read a .lo or .la file. Returns 0 if it can't be read. */
+static int ltFileRead(struct Options *opt, const char *path, struct LtFile *lt)
+{
+    struct stat sb;
+    ssize_t rd;
+    size_t used = 0;
+    char *line;
+    int fd;
+    long long start = traceNow();
+
+    lt->buf = NULL;
+    lt->sane = 0;
+    INIT_BUFFER(lt->vars);
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return 0;
+    if (fstat(fd, &sb) != 0) {
+        close(fd);
+        return 0;
+    }
+    ORL(lt->buf, malloc, NULL, (sb.st_size + 1));
+    while (used < (size_t) sb.st_size &&
+           (rd = read(fd, lt->buf + used, sb.st_size - used)) > 0)
+        used += rd;
+    close(fd);
+    lt->buf[used] = '\0';
+
+    lt->sane = !strncmp(lt->buf, SANE_HEADER, sizeof(SANE_HEADER) - 1);
+
+    /* find all the name=value lines */
+    for (line = lt->buf; *line;) {
+        char *eq;
+
+        while (*line == ' ' || *line == '\t') line++;
+        eq = line;
+        while (*eq == '_' || (*eq >= 'a' && *eq <= 'z') ||
+               (*eq >= 'A' && *eq <= 'Z') || (*eq >= '0' && *eq <= '9'))
+            eq++;
+
+        if (*line == '#' || eq == line || *eq != '=') {
+            /* not a variable */
+            line = strchr(line, '\n');
+            if (!line) break;
+            line++;
+            continue;
         }
+
+        *eq = '\0';
+        WRITE_BUFFER(lt->vars, line);
+        WRITE_BUFFER(lt->vars, eq + 1);
+        line = ltFileValue(eq + 1);
     }
+
+    traceFile("read", "read", start, path);
+    return 1;
+}
+
+/* Get a variable from a .lo or .la file */
+static char *ltFileGet(struct LtFile *lt, const char *name)
+{
+    size_t i;
+    for (i = 0; i + 1 < lt->vars.bufused; i += 2)
+        if (!strcmp(lt->vars.buf[i], name)) return lt->vars.buf[i+1];
+    return NULL;
+}
+
+/* Free a .lo or .la file */
+static void ltFileFree(struct LtFile *lt)
+{
+    free(lt->buf);
+    FREE_BUFFER(lt->vars);
 }
 
 /* Check for sanity by reading a .lo file. If cc is provided, fall back to that
@@ -377,15 +1951,12 @@ static int checkLoSanity(struct Options *opt, char *cc)
         if (arg[0] != '-') {
             char *ext = strrchr(arg, '.');
             if (ext && (!strcmp(ext, ".lo") || !strcmp(ext, ".la"))) {
-                FILE *f;
+                struct LtFile lt;
 
                 foundlo = 1;
-                f = fopen(arg, "r");
-                if (f) {
-                    char buf[sizeof(SANE_HEADER)];
-                    fgets(buf, sizeof(SANE_HEADER), f);
-                    if (!strcmp(buf, SANE_HEADER)) sane = 1;
-                    fclose(f);
+                if (ltFileRead(opt, arg, &lt)) {
+                    sane = lt.sane;
+                    ltFileFree(&lt);
                     break;
                 }
             }
@@ -393,7 +1964,7 @@ static int checkLoSanity(struct Options *opt, char *cc)
     }
 
     if (!foundlo && cc)
-        return systemIsSane(cc, opt->cmd);
+        return systemIsSane(opt, cc, opt->cmd, NULL, 1);
 
     return sane;
 }
@@ -405,14 +1976,25 @@ static void usage(enum Mode mode);
 static void ltcompile(struct Options *);
 static void ltlink(struct Options *);
 static void ltinstall(struct Options *);
+static void ltexecute(struct Options *);
+
+/* server mode */
+static void serverRun(struct Options *opt, const char *path, int idleTimeout);
+static void serverClient(const char *path, int argc, char **argv);
+static void batchRun(struct Options *opt, const char *path, int optEnd,
+                     char **argv);
 
 int main(int argc, char **argv)
 {
     int argi;
+    char *server = NULL, *serverEnv, *batch = NULL, *trace = NULL;
+    char *stats = NULL;
+    long long start = traceNow();
+    int idleTimeout = 300;
 
     /* options */
     struct Options opt;
-    int insane = 0;
+    char *insane = NULL; /* the first option we don't understand */
     char *modeS = NULL;
     enum Mode mode = MODE_UNKNOWN;
     int sane = 0;
@@ -428,6 +2010,78 @@ int main(int argc, char **argv)
         } else if (!strcmp(arg, "--enable-shared")) {
             opt.buildShared = 1;
 
+        } else if (!strcmp(arg, "--fork")) {
+            opt.forkLaunch = 1;
+
+        } else if (!strcmp(arg, "--optimistic")) {
+            opt.optimistic = 1;
+
+        } else if (!strcmp(arg, "--external-ar")) {
+            opt.externalAr = 1;
+
+        } else if (!strcmp(arg, "--thin-convenience")) {
+            opt.thinConvenience = 1;
+
+        } else if (!strcmp(arg, "--external-install")) {
+            opt.externalInstall = 1;
+
+        } else if (!strncmp(arg, "--trace=", 8)) {
+            trace = arg + 8;
+
+        } else if (!strncmp(arg, "--stats=", 8)) {
+            stats = arg + 8;
+
+        } else if (!strncmp(arg, "--fallback-log=", 15)) {
+            opt.fallbackLog = arg + 15;
+
+        } else if (!strcmp(arg, "--link-cache")) {
+            opt.linkCache = 1;
+
+        } else if (!strcmp(arg, "--runpath")) {
+            opt.runpath = 1;
+
+        } else if (!strcmp(arg, "--object-cache")) {
+            opt.objectCache = "";
+
+        } else if (!strncmp(arg, "--object-cache=", 15)) {
+            opt.objectCache = arg + 15;
+
+        } else if (!strcmp(arg, "--object-cache-hardlink")) {
+            opt.objectCacheLink = 1;
+
+        } else if (!strncmp(arg, "--object-cache-size=", 20)) {
+            char *end;
+            opt.objectCacheMax = strtoll(arg + 20, &end, 10);
+            switch (*end) {
+                case 'G': case 'g': opt.objectCacheMax *= 1024; /* fallthrough */
+                case 'M': case 'm': opt.objectCacheMax *= 1024; /* fallthrough */
+                case 'K': case 'k': opt.objectCacheMax *= 1024;
+            }
+
+        } else if (!strcmp(arg, "--batch") && argi < argc - 1) {
+            batch = argv[++argi];
+
+        } else if (!strncmp(arg, "--batch=", 8)) {
+            batch = arg + 8;
+
+        } else if (!strcmp(arg, "--server")) {
+            server = ".mlibtool.sock";
+
+        } else if (!strncmp(arg, "--server=", 9)) {
+            server = arg + 9;
+
+        } else if (!strncmp(arg, "--idle-timeout=", 15)) {
+            idleTimeout = atoi(arg + 15);
+
+        } else if (!strncmp(arg, "--jobs=", 7)) {
+            opt.maxJobs = atoi(arg + 7);
+
+        } else if (!strcmp(arg, "-j") && argi < argc - 1) {
+            opt.maxJobs = atoi(argv[++argi]);
+
+        } else if (!strncmp(arg, "-j", 2) && arg[2]) {
+            opt.maxJobs = atoi(arg + 2);
+
         } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
             usage(MODE_UNKNOWN);
             exit(0);
@@ -444,6 +2098,45 @@ int main(int argc, char **argv)
     if (!opt.buildStatic && !opt.buildShared)
         opt.buildStatic = opt.buildShared = 1;
 
+    /* by default, cache up to 1GB of objects */
+    if (opt.objectCacheMax <= 0)
+        opt.objectCacheMax = 1024LL * 1024 * 1024;
+
+    /* either be a server, or maybe ask one to do our work */
+    if (server)
+        serverRun(&opt, server, idleTimeout);
+
+    /* by default, run as many children at once as make's jobserver allows,
+     * or one at a time without one */
+    jobserverInit();
+    if (opt.maxJobs < 1)
+        opt.maxJobs = (jobserverRead >= 0) ? INT_MAX : 1;
+
+    if (!batch && !inServerWorker &&
+        (serverEnv = getenv("MLIBTOOL_SERVER")) && serverEnv[0])
+        serverClient(serverEnv, argc, argv);
+
+    /* maybe trace what we do */
+    if (!trace && getenv("MLIBTOOL_TRACE") && getenv("MLIBTOOL_TRACE")[0])
+        trace = getenv("MLIBTOOL_TRACE");
+    if (trace)
+        traceInit(trace, argv, start);
+
+    /* and what it costs */
+    if (!stats && getenv("MLIBTOOL_STATS") && getenv("MLIBTOOL_STATS")[0])
+        stats = getenv("MLIBTOOL_STATS");
+    if (stats)
+        statsInit(stats, start);
+    if (!opt.fallbackLog && getenv("MLIBTOOL_FALLBACK_LOG") &&
+        getenv("MLIBTOOL_FALLBACK_LOG")[0])
+        opt.fallbackLog = getenv("MLIBTOOL_FALLBACK_LOG");
+
+    if (batch) {
+        statsMode = "batch";
+        statsOutput = batch;
+        batchRun(&opt, batch, argi, argv);
+    }
+
     /* next argument must be target libtool */
     opt.arglt = argi;
     for (; argi < argc && argv[argi][0] != '-'; argi++);
@@ -482,8 +2175,8 @@ int main(int argc, char **argv)
                    !strcmp(arg, "--no-verbose")) {
             /* ignored for compatibility */
 
-        } else {
-            insane = 1;
+        } else if (!insane) {
+            insane = arg;
 
         }
     }
@@ -497,12 +2190,15 @@ int main(int argc, char **argv)
     }
 
     /* check the mode */
+    statsMode = modeS;
     if (!strcmp(modeS, "compile")) {
         mode = MODE_COMPILE;
     } else if (!strcmp(modeS, "link")) {
         mode = MODE_LINK;
     } else if (!strcmp(modeS, "install")) {
         mode = MODE_INSTALL;
+    } else if (!strcmp(modeS, "execute")) {
+        mode = MODE_EXECUTE;
     }
 
     /* if they're asking for mode help, give it to them */
@@ -513,21 +2209,37 @@ int main(int argc, char **argv)
         }
     }
 
+    traceSpan("mlibtool", "arguments", start, NULL);
+
     /* next argument is the compiler, use that to check for sanity */
+    start = traceNow();
     if (!insane) {
         if (mode == MODE_COMPILE) {
-            sane = systemIsSane(opt.cmd[0], opt.cmd);
+            /* with --optimistic, the compile can check for itself */
+            sane = systemIsSane(&opt, opt.cmd[0], opt.cmd, &opt.defaultPic,
+                                !opt.optimistic);
+            if (sane == -1) {
+                opt.checkSanity = 1;
+                sane = 1;
+            }
         } else if (mode == MODE_LINK) {
             sane = checkLoSanity(&opt, opt.cmd[0]);
-        } else if (mode == MODE_INSTALL) {
+        } else if (mode == MODE_INSTALL || mode == MODE_EXECUTE) {
             /* we can always do something here */
             sane = 1;
         }
     }
+    traceSpan("sanity", "sanity", start, NULL);
+
+    if (insane) {
+        execLibtool(&opt, "unsupported option %s", insane);
 
-    if (!sane) {
+    } else if (mode == MODE_UNKNOWN) {
+        execLibtool(&opt, "unsupported mode %s", modeS);
+
+    } else if (!sane) {
         /* just go to libtool */
-        execLibtool(&opt);
+        execLibtool(&opt, "%s failed the sanity check", opt.cmd[0]);
 
     } else if (mode == MODE_COMPILE) {
         ltcompile(&opt);
@@ -538,11 +2250,12 @@ int main(int argc, char **argv)
     } else if (mode == MODE_INSTALL) {
         ltinstall(&opt);
 
-    } else {
-        execLibtool(&opt);
+    } else if (mode == MODE_EXECUTE) {
+        ltexecute(&opt);
 
     }
 
+    arenaFree(&opt);
     return 0;
 }
 
@@ -554,6 +2267,49 @@ static void usage(enum Mode mode)
            "\t--enable-static: build non-PIC .o files and build .a files\n"
            "\t--enable-shared: build PIC .o files and build .so files\n"
            "\t(if neither is specified, both --enable-static and --enable-shard are assumed)\n"
+           "\t--jobs=<n>|-j <n>: run up to <n> children at once (e.g. the PIC and\n"
+           "\t                   non-PIC compiles of one file); under make -j,\n"
+           "\t                   each child beyond the first also takes a token\n"
+           "\t                   from make's jobserver (default: as many as\n"
+           "\t                   make allows, or 1 outside of make -j)\n"
+           "\t--fork: launch children with fork+exec instead of posix_spawn\n"
+           "\t--optimistic: instead of asking the preprocessor whether the target\n"
+           "\t              is supported, check during the compile itself\n"
+           "\t--external-ar: make static libraries with $AR and $RANLIB (default:\n"
+           "\t               ar and ranlib) instead of writing them directly\n"
+           "\t--thin-convenience: make convenience libraries (those without\n"
+           "\t                    -rpath) thin archives, referring to their\n"
+           "\t                    objects instead of copying them\n"
+           "\t--external-install: install with the given install command and cp\n"
+           "\t                    instead of copying files directly\n"
+           "\t--object-cache[=<dir>]: reuse objects from identical compiles,\n"
+           "\t                        cached in <dir> (default:\n"
+           "\t                        $XDG_CACHE_HOME/mlibtool/objects)\n"
+           "\t--object-cache-size=<n>[K|M|G]: limit the object cache to <n>\n"
+           "\t                               bytes (default: 1G)\n"
+           "\t--object-cache-hardlink: hard link objects to and from the\n"
+           "\t                         object cache instead of copying them\n"
+           "\t                         (they must then never be modified\n"
+           "\t                         in place)\n"
+           "\t--link-cache: don't run the linker or ar again when a library\n"
+           "\t              or program's inputs haven't changed\n"
+           "\t--runpath: link programs to run in place, finding uninstalled\n"
+           "\t           libraries by an rpath relative to themselves, instead\n"
+           "\t           of making wrapper scripts (as with -no-install)\n"
+           "\t--batch <file>|--batch=<file>: run the libtool command lines in\n"
+           "\t                               <file> (- for stdin) as jobs, up to\n"
+           "\t                               --jobs at once\n"
+           "\t--trace=<file>: append Chrome trace events for what mlibtool does\n"
+           "\t                to <file> (also MLIBTOOL_TRACE=<file>)\n"
+           "\t--stats=<file>: append a line of timings and resource use for\n"
+           "\t                each invocation to <file> (also MLIBTOOL_STATS=<file>)\n"
+           "\t--fallback-log=<file>: when falling back to libtool, log why, and\n"
+           "\t                how long it took, to <file> (also\n"
+           "\t                MLIBTOOL_FALLBACK_LOG=<file>)\n"
+           "\t--server[=<socket>]: serve requests from mlibtool invocations\n"
+           "\t                     run with MLIBTOOL_SERVER=<socket> (default\n"
+           "\t                     socket: .mlibtool.sock)\n"
+           "\t--idle-timeout=<sec>: exit the server after <sec> idle seconds\n"
            "\n"
            "Options:\n"
            "\t-n|--dry-run: display commands without modifying any files\n"
@@ -561,6 +2317,8 @@ static void usage(enum Mode mode)
            "\n");
     printf("<mode> must be one of the following:\n"
            "\tcompile: compile a source file into a libtool object\n"
+           "\texecute: run a program using the uninstalled libraries it was\n"
+           "\t         linked with\n"
            "\tinstall: install libraries or executables\n"
            "\tlink: create a library or an executable\n"
            "\n");
@@ -582,6 +2340,7 @@ static void usage(enum Mode mode)
                "\t-export-dynamic: cc -rdynamic\n"
                "\t-L<dir>: search both <dir> and <dir>/.libs\n"
                "\t-module: build a module suitable for dlopen\n"
+               "\t-no-install: link a program to run in place, without a wrapper\n"
                "\t-rpath <dir>: build a shared library to be installed to <dir>\n"
                "\t              (note: this flag is REQUIRED to build a shared\n"
                "\t               library, but does NOT set an RPATH in the\n"
@@ -604,6 +2363,10 @@ static void usage(enum Mode mode)
     } else if (mode == MODE_INSTALL) {
         printf("\t(none)\n\n");
 
+    } else if (mode == MODE_EXECUTE) {
+        printf("\t-dlopen <file>: add the directory of <file> to the library path\n"
+               "\n");
+
     }
 
     printf("mlibtool is a mini version of libtool for sensible systems. If you're\n"
@@ -613,9 +2376,507 @@ static void usage(enum Mode mode)
         "Unrecognized invocations will be redirected to <target-libtool>.\n");
 }
 
+/* SHA-256, for naming objects in the object cache by what went into them */
+struct Sha256 {
+    unsigned int h[8];
+    unsigned long long len;
+    unsigned char buf[64];
+};
+
+static const unsigned int sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256Init(struct Sha256 *s)
+{
+    static const unsigned int init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(s->h, init, sizeof(init));
+    s->len = 0;
+}
+
+static void sha256Block(struct Sha256 *s, const unsigned char *p)
+{
+    unsigned int w[64], v[8], t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = ((unsigned int) p[i*4] << 24) | ((unsigned int) p[i*4+1] << 16) |
+               ((unsigned int) p[i*4+2] << 8) | p[i*4+3];
+    for (; i < 64; i++)
+        w[i] = w[i-16] + w[i-7] +
+               (ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3)) +
+               (ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ (w[i-2] >> 10));
+
+    memcpy(v, s->h, sizeof(v));
+    for (i = 0; i < 64; i++) {
+        t1 = v[7] + (ROR32(v[4], 6) ^ ROR32(v[4], 11) ^ ROR32(v[4], 25)) +
+             ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256K[i] + w[i];
+        t2 = (ROR32(v[0], 2) ^ ROR32(v[0], 13) ^ ROR32(v[0], 22)) +
+             ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(v + 1, v, 7 * sizeof(unsigned int));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for (i = 0; i < 8; i++)
+        s->h[i] += v[i];
+}
+
+static void sha256Update(struct Sha256 *s, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t used = s->len % 64, n;
+
+    s->len += len;
+    while (len) {
+        n = 64 - used;
+        if (n > len) n = len;
+        memcpy(s->buf + used, p, n);
+        used += n;
+        p += n;
+        len -= n;
+        if (used == 64) {
+            sha256Block(s, s->buf);
+            used = 0;
+        }
+    }
+}
+
+/* Finish a hash, writing it in hex to out */
+static void sha256Final(struct Sha256 *s, char out[65])
+{
+    unsigned long long bits = s->len * 8;
+    unsigned char pad[72];
+    size_t padLen = 64 - (s->len + 8) % 64, i;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++)
+        pad[padLen + i] = bits >> (56 - i * 8);
+    sha256Update(s, pad, padLen + 8);
+
+    for (i = 0; i < 8; i++)
+        sprintf(out + i * 8, "%08x", s->h[i]);
+}
+
+/* With --object-cache, compiled objects are kept in a directory named by the
+ * SHA-256 of the compiler's identity, the compile command and the
+ * preprocessed source, so an identical compile can reuse them instead. Each
+ * entry is <dir>/xx/<rest of hash>.o, with a .d beside it if the compile
+ * writes a dependency file. The cache is split over 256 subdirectories, each
+ * kept to its share of the size limit by discarding the least recently used
+ * files. Objects are cloned to and from the cache where the filesystem allows,
+ * and copied otherwise, unless --object-cache-hardlink asks for hard links. */
+
+/* How does an argument affect the object cache? Returns -1 if a compile using
+ * it can't be cached, otherwise the number of arguments (starting at this
+ * one) to leave out when preprocessing, and notes dependency file flags in
+ * *deps. */
+static int objectCacheArg(char **cmd, size_t i, int *deps)
+{
+    char *arg = cmd[i];
+
+    if (!strcmp(arg, "-MD") || !strcmp(arg, "-MMD")) {
+        *deps |= 1;
+        return 1;
+
+    } else if (!strcmp(arg, "-MP")) {
+        return 1;
+
+    } else if (!strncmp(arg, "-MF", 3) || !strncmp(arg, "-MT", 3) ||
+               !strncmp(arg, "-MQ", 3)) {
+        *deps |= (arg[2] == 'F') ? 2 : 4;
+        if (arg[3]) return 1;
+        return cmd[i+1] ? 2 : -1;
+
+    } else if (!strcmp(arg, "-") || arg[0] == '@' ||
+               !strcmp(arg, "-E") || !strcmp(arg, "-S") ||
+               !strncmp(arg, "-M", 2) ||
+               !strncmp(arg, "-Wp,", 4) ||
+               !strcmp(arg, "-Xpreprocessor") ||
+               !strncmp(arg, "-save-temps", 11) ||
+               !strcmp(arg, "--coverage") ||
+               !strcmp(arg, "-ftest-coverage") ||
+               !strcmp(arg, "-fprofile-arcs") ||
+               !strncmp(arg, "-fprofile-use", 13) ||
+               !strncmp(arg, "-fauto-profile", 14) ||
+               !strncmp(arg, "-fdump-", 7) ||
+               !strcmp(arg, "-frecord-gcc-switches") ||
+               !strcmp(arg, "-gsplit-dwarf")) {
+        /* reads or writes something besides the source and object */
+        return -1;
+
+    }
+
+    return 0;
+}
+
+/* Can this compile be cached? If so, also gets the dependency file it writes,
+ * if any. A dependency file is only the same for the same source if its
+ * target is given explicitly, rather than taken from the object name. */
+static int objectCacheable(char **cmd, char **depFile)
+{
+    size_t i;
+    int n, deps = 0, compile = 0;
+
+    *depFile = NULL;
+    for (i = 1; cmd[i]; i += n) {
+        n = objectCacheArg(cmd, i, &deps);
+        if (n < 0) return 0;
+        if (!strncmp(cmd[i], "-MF", 3))
+            *depFile = cmd[i][3] ? cmd[i] + 3 : cmd[i+1];
+        if (!strcmp(cmd[i], "-c"))
+            compile = 1;
+        if (n == 0) n = 1;
+    }
+
+    if (!(deps & 1))
+        *depFile = NULL;
+    return compile && (!(deps & 1) || (deps & 6) == 6);
+}
+
+/* Hash a compile command, less its output name (at outPos), and make the same
+ * command preprocessing to stdout. Returns -1 if it can't be hashed. */
+static int objectCacheHashCmd(struct Options *opt, struct Sha256 *sha,
+                              const char *ident, char **cmd, size_t outPos,
+                              struct Buffer *ppCmd)
+{
+    char cwd[4096];
+    size_t i;
+    int n, deps = 0, debug = 0;
+
+    sha256Init(sha);
+    sha256Update(sha, "mlibtool object cache 1", 24);
+    sha256Update(sha, ident, strlen(ident) + 1);
+
+    for (i = 0; cmd[i]; i += n) {
+        n = 1;
+        if (i == outPos - 1) {
+            sha256Update(sha, "-o", 3);
+            n = 2;
+            continue;
+        }
+        sha256Update(sha, cmd[i], strlen(cmd[i]) + 1);
+        if (i && (n = objectCacheArg(cmd, i, &deps)) > 0) {
+            if (n > 1) sha256Update(sha, cmd[i+1], strlen(cmd[i+1]) + 1);
+            continue;
+        }
+        n = 1;
+        if (!strncmp(cmd[i], "-g", 2) && strcmp(cmd[i], "-g0"))
+            debug = 1;
+        WRITE_BUFFER(*ppCmd, strcmp(cmd[i], "-c") ? cmd[i] : "-E");
+    }
+    WRITE_BUFFER(*ppCmd, NULL);
+
+    /* debugging information names the directory it was compiled in */
+    if (debug) {
+        if (!getcwd(cwd, sizeof(cwd)))
+            return -1;
+        sha256Update(sha, cwd, strlen(cwd) + 1);
+    }
+    return 0;
+}
+
+/* Run a preprocessing command, reading its output into *out (allocated).
+ * Returns -1 if it fails. */
+static int objectCachePreprocess(struct Options *opt, char **ppCmd,
+                                 char **out, size_t *outSz)
+{
+    size_t used = 0, sz = 65536;
+    ssize_t rd;
+    int pipeo[2], tmpi;
+    pid_t pid;
+
+    ORX(tmpi, pipe, -1, (pipeo));
+    fcntl(pipeo[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipeo[1], F_SETFD, FD_CLOEXEC);
+    pid = launch(opt, ppCmd, -1, pipeo[1]);
+    close(pipeo[1]);
+    if (pid < 0) {
+        perror(ppCmd[0]);
+        close(pipeo[0]);
+        return -1;
+    }
+    ORX(*out, malloc, NULL, (sz));
+    while ((rd = read(pipeo[0], *out + used, sz - used)) != 0) {
+        if (rd < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        used += rd;
+        if (used == sz) {
+            sz *= 2;
+            ORX(*out, realloc, NULL, (*out, sz));
+        }
+    }
+    close(pipeo[0]);
+    *outSz = used;
+
+    /* if it didn't preprocess, it won't compile either */
+    while (waitpid(pid, &tmpi, 0) < 0 && errno == EINTR);
+    if (rd < 0 || tmpi != 0) {
+        free(*out);
+        *out = NULL;
+        if (rd >= 0 && WIFEXITED(tmpi))
+            spawnFailed(opt);
+        return -1;
+    }
+    return 0;
+}
+
+/* Does this text mention a macro that differs between PIC and non-PIC
+ * compiles (PIC, __PIC__, __pic__, or the same for PIE)? */
+static int mentionsPicMacro(const char *buf, size_t sz)
+{
+    const char *p, *end = buf + sz;
+
+    for (p = buf; (p = memchr(p, 'P', end - p)); p++)
+        if (end - p >= 3 && p[1] == 'I' && (p[2] == 'C' || p[2] == 'E'))
+            return 1;
+    for (p = buf; (p = memchr(p, 'p', end - p)); p++)
+        if (p - buf >= 2 && end - p >= 5 && !memcmp(p - 2, "__pi", 4) &&
+            (p[2] == 'c' || p[2] == 'e') && !memcmp(p + 3, "__", 2))
+            return 1;
+    return 0;
+}
+
+/* Would the PIC compile preprocess to exactly this non-PIC output? Only if no
+ * file it came from (by its line markers) mentions a PIC macro, as nothing
+ * else differs. */
+static int objectCacheSharedPp(struct Options *opt, const char *pp, size_t sz)
+{
+    const char *line, *end = pp + sz, *name, *nameEnd, *last = NULL;
+    size_t lastLen = 0;
+    struct stat sb;
+    void *map;
+    int fd, mentions;
+
+    for (line = pp; line < end; line = nameEnd + 1) {
+        if (!(nameEnd = memchr(line, '\n', end - line)))
+            nameEnd = end;
+
+        /* line markers are # <line> "<file>" ... */
+        if (nameEnd - line < 5 || line[0] != '#' || line[1] != ' ' ||
+            line[2] < '0' || line[2] > '9' ||
+            !(name = memchr(line, '"', nameEnd - line)))
+            continue;
+        name++;
+        if (!(nameEnd = memchr(name, '"', end - name)))
+            return 0;
+        if (name[0] == '<' ||
+            ((size_t) (nameEnd - name) == lastLen && !memcmp(name, last, lastLen)))
+            continue;
+        last = name;
+        lastLen = nameEnd - name;
+
+        /* (names with escapes aren't worth unescaping) */
+        if (memchr(name, '\\', lastLen))
+            return 0;
+        if ((fd = open(arenaPrintf(opt, "%.*s", (int) lastLen, name), O_RDONLY)) < 0)
+            return 0;
+        if (fstat(fd, &sb) != 0) {
+            close(fd);
+            return 0;
+        }
+        mentions = 0;
+        if (sb.st_size > 0) {
+            map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                close(fd);
+                return 0;
+            }
+            mentions = mentionsPicMacro(map, sb.st_size);
+            munmap(map, sb.st_size);
+        }
+        close(fd);
+        if (mentions)
+            return 0;
+    }
+    return 1;
+}
+
+/* Find the cache entries (less their extensions) for the non-PIC and PIC
+ * compiles (either may be NULL) writing their objects to cmd[outPos], by
+ * running the preprocessor. The PIC compile reuses the non-PIC one's
+ * preprocessed source when it would be the same, so usually it only runs
+ * once. Entries that can't be cached are left NULL. */
+static void objectCacheEntries(struct Options *opt, const char *dir,
+                               const char *ident, char **nonPicCmd,
+                               char **picCmd, size_t outPos,
+                               char **nonPicEntry, char **picEntry)
+{
+    struct Sha256 sha;
+    struct Buffer ppCmd;
+    char hash[65], *pp = NULL;
+    size_t ppSz = 0;
+    int i, ret;
+
+    *nonPicEntry = *picEntry = NULL;
+    for (i = 0; i < 2; i++) {
+        char **cmd = i ? picCmd : nonPicCmd;
+        char **entry = i ? picEntry : nonPicEntry;
+        if (!cmd) continue;
+
+        INIT_BUFFER(ppCmd);
+        ret = objectCacheHashCmd(opt, &sha, ident, cmd, outPos, &ppCmd);
+
+        /* preprocess it, if we can't use what we have */
+        if (ret == 0 && pp && !objectCacheSharedPp(opt, pp, ppSz)) {
+            free(pp);
+            pp = NULL;
+        }
+        if (ret == 0 && !pp)
+            ret = objectCachePreprocess(opt, ppCmd.buf, &pp, &ppSz);
+        FREE_BUFFER(ppCmd);
+        if (ret != 0) break;
+
+        sha256Update(&sha, pp, ppSz);
+        sha256Final(&sha, hash);
+        *entry = arenaPrintf(opt, "%s/%.2s/%s", dir, hash, hash + 2);
+    }
+    free(pp);
+}
+
+/* Replace dest with src, by a clone if possible, else a copy, or by a hard link
+ * with --object-cache-hardlink. Returns 0 on success. */
+static int objectCacheCopy(struct Options *opt, const char *src, const char *dest)
+{
+    char *tmpName = arenaPrintf(opt, "%s.tmp.%d", dest, (int) getpid());
+    struct stat sb;
+    int in, out, ret = 0;
+
+    unlink(tmpName);
+    if (!opt->objectCacheLink || link(src, tmpName) != 0) {
+        if ((in = open(src, O_RDONLY)) < 0)
+            return -1;
+        if (fstat(in, &sb) != 0 ||
+            (out = open(tmpName, O_WRONLY|O_CREAT|O_EXCL, 0666)) < 0) {
+            close(in);
+            return -1;
+        }
+#ifdef FICLONE
+        if (ioctl(out, FICLONE, in) != 0)
+#endif
+            ret = copyRange(in, 0, out, sb.st_size);
+        close(in);
+        if (close(out) != 0)
+            ret = -1;
+    }
+
+    if (ret != 0 || rename(tmpName, dest) != 0) {
+        unlink(tmpName);
+        return -1;
+    }
+    return 0;
+}
+
+/* Restore an object (and dependency file) from the cache. Returns 0 on a
+ * hit. */
+static int objectCacheGet(struct Options *opt, const char *entry,
+                          const char *obj, const char *depFile)
+{
+    char *cachedObj = arenaPrintf(opt, "%s.o", entry);
+
+    if (access(cachedObj, R_OK) != 0)
+        return -1;
+    if (depFile &&
+        objectCacheCopy(opt, arenaPrintf(opt, "%s.d", entry), depFile) != 0)
+        return -1;
+    if (objectCacheCopy(opt, cachedObj, obj) != 0)
+        return -1;
+
+    /* it's been used, so keep it (if it's linked, this also makes the object
+     * newer than its source, for make) */
+    utimensat(AT_FDCWD, cachedObj, NULL, 0);
+
+    if (!opt->quiet)
+        fprintf(stderr, "mlibtool: %s is cached\n", obj);
+    return 0;
+}
+
+/* A file in an object cache subdirectory, for eviction */
+struct ObjectCacheFile {
+    char *name;
+    time_t mtime;
+    long long size;
+};
+
+static int objectCacheFileCmp(const void *a, const void *b)
+{
+    const struct ObjectCacheFile *fa = a, *fb = b;
+    return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+/* Remove the least recently used files from an object cache subdirectory
+ * until it's within its share of the size limit */
+static void objectCacheEvict(struct Options *opt, const char *subdir)
+{
+    struct ObjectCacheFile *files = NULL;
+    size_t filesUsed = 0, filesSz = 0, i;
+    long long total = 0, limit = opt->objectCacheMax / 256;
+    struct dirent *de;
+    struct stat sb;
+    DIR *dh;
+
+    if (!(dh = opendir(subdir))) return;
+    while ((de = readdir(dh))) {
+        char *path;
+        if (de->d_name[0] == '.') continue;
+        path = arenaPrintf(opt, "%s/%s", subdir, de->d_name);
+        if (stat(path, &sb) != 0) continue;
+        GROW_ARRAY(opt, files, filesUsed, filesSz);
+        files[filesUsed].name = path;
+        files[filesUsed].mtime = sb.st_mtime;
+        files[filesUsed].size = sb.st_size;
+        total += sb.st_size;
+        filesUsed++;
+    }
+    closedir(dh);
+
+    if (total > limit) {
+        /* make some room, so this doesn't happen on every store */
+        qsort(files, filesUsed, sizeof(*files), objectCacheFileCmp);
+        for (i = 0; i < filesUsed && total > limit - limit / 10; i++) {
+            if (unlink(files[i].name) == 0)
+                total -= files[i].size;
+        }
+    }
+
+    free(files);
+}
+
+/* Store a freshly compiled object (and dependency file) in the cache */
+static void objectCachePut(struct Options *opt, const char *entry,
+                           const char *obj, const char *depFile)
+{
+    char *subdir = arenaDirname(opt, entry);
+
+    mkdir(subdir, 0777);
+    if (depFile &&
+        objectCacheCopy(opt, depFile, arenaPrintf(opt, "%s.d", entry)) != 0)
+        return;
+    if (objectCacheCopy(opt, obj, arenaPrintf(opt, "%s.o", entry)) != 0)
+        return;
+    objectCacheEvict(opt, subdir);
+}
+
 static void ltcompile(struct Options *opt)
 {
-    struct Buffer outCmd;
+    struct Buffer outCmd, picCmd;
     size_t i;
     char *ext;
     FILE *f;
@@ -626,18 +2887,29 @@ static void ltcompile(struct Options *opt)
     size_t outNamePos = 0;
     int preferPic = 0, preferNonPic = 0;
     int buildPic = 0, buildNonPic = 0;
+    int picFlags = 0;
+    char *sanityHeader = NULL;
+    char *const *cmds[2];
+    size_t ncmds = 0, mfPos;
+    char *nonPicDepFile = NULL;
+
+    /* object cache entries */
+    char *cacheDir = NULL, *ident, *ccPath, *depFile = NULL;
+    char *picEntry = NULL, *nonPicEntry = NULL;
+    int picCached = 0, nonPicCached = 0;
+    struct stat sb;
+    long long start;
 
     /* option derivatives */
-    char *outDirC = NULL,
-         *outDir = NULL,
+    char *outDir = NULL,
          *libsDir = NULL,
-         *outBaseC = NULL,
          *outBase = NULL,
          *picFile = NULL,
          *nonPicFile = NULL;
 
-    /* allocate the output command */
+    /* allocate the output commands */
     INIT_BUFFER(outCmd);
+    INIT_BUFFER(picCmd);
 
     /* and copy it in */
     WRITE_BUFFER(outCmd, opt->cmd[0]);
@@ -649,7 +2921,7 @@ static void ltcompile(struct Options *opt)
             if (!strcmp(arg, "-o") && narg) {
                 /* output name */
                 WRITE_BUFFER(outCmd, arg);
-                ORL(outName, strdup, NULL, (narg));
+                outName = narg;
                 outNamePos = outCmd.bufused;
                 WRITE_BUFFER(outCmd, narg);
                 i++;
@@ -669,6 +2941,8 @@ static void ltcompile(struct Options *opt)
                 /* ignored for compatibility */
 
             } else {
+                if (isPicFlag(arg))
+                    picFlags = 1;
                 WRITE_BUFFER(outCmd, arg);
 
             }
@@ -686,6 +2960,28 @@ static void ltcompile(struct Options *opt)
         exit(1);
     }
 
+    /* if sanity is unknown, the compile needs to check it */
+    if (opt->checkSanity) {
+        char *header = NULL;
+
+        ext = strrchr(inName, '.');
+        if (ext && isPreprocessedExt(ext + 1))
+            header = sanityCheckHeader();
+
+        if (header) {
+            WRITE_BUFFER(outCmd, "-include");
+            WRITE_BUFFER(outCmd, header);
+            sanityHeader = header;
+
+        } else {
+            /* no way to check it in the compile */
+            opt->checkSanity = 0;
+            if (!systemIsSane(opt, opt->cmd[0], opt->cmd, &opt->defaultPic, 1))
+                execLibtool(opt, "%s failed the sanity check", opt->cmd[0]);
+
+        }
+    }
+
     /* if both preferPic and preferNonPic were specified, neither were specified */
     if (preferPic && preferNonPic)
         preferPic = preferNonPic = 0;
@@ -699,17 +2995,18 @@ static void ltcompile(struct Options *opt)
     else if (!preferPic)
         buildNonPic = opt->buildStatic;
 
+    /* if the compiler generates PIC anyway, a non-PIC compile would just
+     * duplicate the PIC one, so build only the PIC object and use it for
+     * both */
+    if (buildPic && buildNonPic && opt->defaultPic && !picFlags)
+        buildNonPic = 0;
+
     /* if we don't have an output name, guess */
     if (!outName) {
-        /* + 4: .lo\0 */
-        ORL(outName, malloc, NULL, (strlen(inName) + 4));
-        strcpy(outName, inName);
-
-        if ((ext = strrchr(outName, '.'))) {
-            strcpy(ext, ".lo");
-        } else {
-            strcat(outName, ".lo");
-        }
+        ext = strrchr(inName, '.');
+        outName = arenaPrintf(opt, "%.*s.lo",
+                              (int) (ext ? (size_t) (ext - inName) : strlen(inName)),
+                              inName);
 
         /* and add it to the command */
         WRITE_BUFFER(outCmd, "-o");
@@ -730,52 +3027,121 @@ static void ltcompile(struct Options *opt)
         }
 
     }
+    statsOutput = outName;
 
     /* get the directory names */
-    ORL(outDirC, strdup, NULL, (outName));
-    outDir = dirname(outDirC);
-    ORL(outBaseC, strdup, NULL, (outName));
-    outBase = basename(outBaseC);
-    ext = strrchr(outBase, '.');
-    if (ext) *ext = '\0';
+    outDir = arenaDirname(opt, outName);
+    outBase = arenaBasename(opt, outName, 1);
 
     /* make the .libs dir */
-    ORL(libsDir, malloc, NULL, (strlen(outDir) + 7));
-    sprintf(libsDir, "%s/.libs", outDir);
+    libsDir = arenaPrintf(opt, "%s/.libs", outDir);
     if (!opt->dryRun) mkdir(libsDir, 0777); /* ignore errors */
 
     /* and generate the pic/non-pic names */
-    ORL(picFile, malloc, NULL, (strlen(libsDir) + strlen(outBase) + 4));
-    sprintf(picFile, "%s/%s.o", libsDir, outBase);
-    ORL(nonPicFile, malloc, NULL, (strlen(outDir) + strlen(outBase) + 4));
-    sprintf(nonPicFile, "%s/%s.o", outDir, outBase);
+    picFile = arenaLibsPath(opt, outDir, outBase, ".o");
+    nonPicFile = arenaPrintf(opt, "%s/%s.o", outDir, outBase);
 
     /* now do the actual building */
+    if (buildPic) {
+        /* the PIC command is the non-PIC command plus PIC flags */
+        for (i = 0; i < outCmd.bufused; i++)
+            WRITE_BUFFER(picCmd, outCmd.buf[i]);
+        WRITE_BUFFER(picCmd, "-fPIC");
+        WRITE_BUFFER(picCmd, "-DPIC");
+        picCmd.buf[outNamePos] = picFile;
+        WRITE_BUFFER(picCmd, NULL);
+    }
     if (buildNonPic) {
         outCmd.buf[outNamePos] = nonPicFile;
         WRITE_BUFFER(outCmd, NULL);
-        spawn(opt, outCmd.buf);
-        outCmd.bufused--;
+    }
 
-        if (!buildPic && !opt->dryRun)
-            link(nonPicFile, picFile);
+    /* maybe the object cache has them already */
+    if (opt->objectCache && !opt->dryRun && !opt->checkSanity &&
+        (buildPic || buildNonPic) &&
+        objectCacheable(buildNonPic ? outCmd.buf : picCmd.buf, &depFile)) {
+        if (opt->objectCache[0]) {
+            cacheDir = opt->objectCache;
+        } else if ((cacheDir = userCacheDir())) {
+            char *dir = cacheDir;
+            cacheDir = arenaPrintf(opt, "%s/objects", dir);
+            free(dir);
+        }
+    }
+    if (cacheDir && (ident = compilerIdentity(opt->cmd[0], opt->cmd, &ccPath, &sb))) {
+        start = traceNow();
+        mkdir(cacheDir, 0777);
+        objectCacheEntries(opt, cacheDir, ident,
+                           buildNonPic ? outCmd.buf : NULL,
+                           buildPic ? picCmd.buf : NULL, outNamePos,
+                           &nonPicEntry, &picEntry);
+        if (picEntry)
+            picCached = !objectCacheGet(opt, picEntry, picFile, depFile);
+        if (nonPicEntry)
+            nonPicCached = !objectCacheGet(opt, nonPicEntry, nonPicFile, depFile);
+        traceSpan("cache", "object cache lookup", start, NULL);
+        free(ident);
+        free(ccPath);
+    }
 
+    /* a linked object may be in the cache, so don't compile over it */
+    if (opt->objectCacheLink && !opt->dryRun) {
+        if (buildPic && !picCached) unlink(picFile);
+        if (buildNonPic && !nonPicCached) unlink(nonPicFile);
     }
 
-    if (buildPic) {
-        WRITE_BUFFER(outCmd, "-fPIC");
-        WRITE_BUFFER(outCmd, "-DPIC");
-        outCmd.buf[outNamePos] = picFile;
+    /* compile the rest, PIC first as libtool does */
+    if (buildPic && !picCached)
+        cmds[ncmds++] = picCmd.buf;
+    if (buildNonPic && !nonPicCached)
+        cmds[ncmds++] = outCmd.buf;
 
-        WRITE_BUFFER(outCmd, NULL);
-        spawn(opt, outCmd.buf);
-        outCmd.bufused--;
+    if (ncmds == 2 && compileSideOutputs(outCmd.buf, &mfPos)) {
+        /* they'd both write the same files, so one after the other */
+        spawnParallel(opt, cmds, 1);
+        spawnParallel(opt, cmds + 1, 1);
+
+    } else {
+        /* the compiles are independent, so may run together, with the
+         * non-PIC one's dependencies going elsewhere to be thrown away */
+        if (ncmds == 2 && mfPos) {
+            char *arg = outCmd.buf[mfPos];
+            char *dep = arg[3] ? arg + 3 : outCmd.buf[mfPos+1];
+            nonPicDepFile = arenaPrintf(opt, "%s.%d.nonpic", dep, (int) getpid());
+            if (arg[3])
+                outCmd.buf[mfPos] = arenaPrintf(opt, "-MF%s", nonPicDepFile);
+            else
+                outCmd.buf[mfPos+1] = nonPicDepFile;
+        }
+        spawnParallel(opt, cmds, ncmds);
+
+    }
+
+    /* each entry gets the dependencies its own compile wrote */
+    if (picEntry && !picCached)
+        objectCachePut(opt, picEntry, picFile, depFile);
+    if (nonPicEntry && !nonPicCached)
+        objectCachePut(opt, nonPicEntry, nonPicFile,
+                       nonPicDepFile ? nonPicDepFile : depFile);
+    if (nonPicDepFile && !opt->dryRun)
+        unlink(nonPicDepFile);
+
+    /* if we only built one, it's both */
+    if (!opt->dryRun && buildPic != buildNonPic) {
+        char *built = buildPic ? picFile : nonPicFile;
+        char *other = buildPic ? nonPicFile : picFile;
+        unlink(other);
+        link(built, other);
+    }
 
-        if (!buildNonPic && !opt->dryRun)
-            link(picFile, nonPicFile);
+    /* an optimistic compile that worked tells us we're sane */
+    if (opt->checkSanity && !opt->dryRun) {
+        opt->checkSanity = 0;
+        systemRecordSanity(opt->cmd[0], opt->cmd);
     }
 
     /* and finally, write the .lo file */
+    start = traceNow();
     f = fopen(outName, "w");
     if (!f) {
         perror(outName);
@@ -787,791 +3153,3740 @@ static void ltcompile(struct Options *opt)
                "non_pic_object='%s.o'\n",
                outBase, outBase);
     fclose(f);
+    traceFile("write", "write", start, outName);
 
-    free(nonPicFile);
-    free(picFile);
-    free(libsDir);
-    free(outBaseC);
-    free(outDirC);
-    free(outName);
+    free(sanityHeader);
 
+    FREE_BUFFER(picCmd);
     FREE_BUFFER(outCmd);
 }
 
 /* add a canonicalized library dir to the list */
 static void addLibDir(struct Options *opt,
                       struct Buffer *libDirs,
-                      struct Buffer *tofree,
                       char *dir)
 {
-    char *libDir;
-    if ((libDir = realpath(dir, NULL))) {
+    char *libDir, *key = NULL;
+    const char *cached;
+    struct stat sb;
+
+    /* a server may already know */
+    if (MEM_CACHE_ACTIVE()) {
+        char *abs = absPath(dir);
+        ORL(key, malloc, NULL, (strlen(abs) + 5));
+        sprintf(key, "dir:%s", abs);
+        free(abs);
+
+        if ((cached = memCacheGet(key))) {
+            WRITE_BUFFER(*libDirs, arenaStrdup(opt, cached));
+            free(key);
+            return;
+        }
+        if (stat(dir, &sb) != 0) {
+            free(key);
+            key = NULL;
+        }
+    }
+
+    if ((libDir = arenaRealpath(opt, dir))) {
         WRITE_BUFFER(*libDirs, libDir);
-        WRITE_BUFFER(*tofree, libDir);
+        if (key)
+            memCachePut(key, key + 4, &sb, libDir);
     } else {
         WRITE_BUFFER(*libDirs, dir);
     }
+    free(key);
 }
 
-/* the most complicated part of linking is linking in .la files */
-static void linkLaFile(struct Options *opt,
-                       int buildLib,
-                       struct Buffer *outCmd,
-                       struct Buffer *libDirs,
-                       struct Buffer *dependencyLibs,
-                       struct Buffer *tofree,
-                       char *arg)
+/* Read the dependency_libs of a .la file (into the arena) */
+static char *laDependencyLibs(struct Options *opt, char *laFile)
 {
-    /* link to this library */
-    char *laDirC, *laDir, *laBaseC, *laBase, *aarg, *ext;
-    int wholeArchive = 0;
-    FILE *f;
-
-    /* OK, it's a .la file, figure out the .libs name */
-    ORL(laDirC, strdup, NULL, (arg));
-    laDir = dirname(laDirC);
-    ORL(laBaseC, strdup, NULL, (arg));
-    laBase = basename(laBaseC);
-
-    /* get the -l name */
-    ext = strrchr(laBase, '.');
-    if (ext) *ext = '\0';
+    char *key = NULL, *ret = NULL;
+    const char *cached;
+    struct stat sb;
+    struct LtFile lt;
+
+    /* a server may already know */
+    if (MEM_CACHE_ACTIVE()) {
+        char *abs = absPath(laFile);
+        ORL(key, malloc, NULL, (strlen(abs) + 4));
+        sprintf(key, "la:%s", abs);
+        free(abs);
+
+        if ((cached = memCacheGet(key))) {
+            free(key);
+            return arenaStrdup(opt, cached);
+        }
+        if (stat(laFile, &sb) != 0) {
+            free(key);
+            key = NULL;
+        }
+    }
 
-    /* add -L for the .libs path */
-    ORL(aarg, malloc, NULL, (strlen(laDir) + 9));
-    sprintf(aarg, "-L%s/.libs", laDir);
-    WRITE_BUFFER(*outCmd, aarg);
-    WRITE_BUFFER(*tofree, aarg);
-    addLibDir(opt, libDirs, tofree, aarg + 2);
+    if (ltFileRead(opt, laFile, &lt)) {
+        char *dlibs = ltFileGet(&lt, "dependency_libs");
+        ret = arenaStrdup(opt, dlibs ? dlibs : "");
+        ltFileFree(&lt);
 
-    /* if there's only a .a, libtool specifies we bring in the whole archive */
-    if (buildLib) {
-        ORL(aarg, malloc, NULL, (strlen(laDir) + strlen(laBase) + 11));
-        sprintf(aarg, "%s/.libs/%s.so", laDir, laBase);
-        if (access(aarg, F_OK) != 0)
-            wholeArchive = 1;
-        free(aarg);
+        if (key)
+            memCachePut(key, key + 3, &sb, ret);
     }
-    if (wholeArchive) {
-        /* this is GNU-ld-specific, so retry if it doesn't work */
-        opt->retryIfFail = 1;
-        WRITE_BUFFER(*outCmd, "-Wl,--whole-archive");
 
-    } else {
-        /* if we're not linking in the whole archive, then this becomes a
-         * dependency */
-        if (dependencyLibs) {
-            char *realla;
-            if ((realla = realpath(arg, NULL))) {
-                WRITE_BUFFER(*dependencyLibs, realla);
-                WRITE_BUFFER(*tofree, realla);
-            } else {
-                WRITE_BUFFER(*dependencyLibs, arg);
-            }
-        }
+    free(key);
+    return ret;
+}
 
-    }
+/* The most complicated part of linking is linking in .la files. Each .la may
+ * depend on others through its dependency_libs, so we read the whole graph of
+ * them once, then link each library only once, in an order that puts every
+ * library before those it depends on. */
+
+/* a .la file in the graph */
+struct LaNode {
+    char *path; /* as first referenced */
+    char *dir, *name; /* directory and -l name */
+    int wholeArchive;
+    size_t *deps; /* .la dependencies, as node indices */
+    size_t depsUsed, depsSz;
+    struct Buffer flags; /* other dependency_libs entries */
+    int mark;
+    size_t last; /* the last root whose closure includes this node */
+    size_t id; /* number in a closure index */
+};
 
-    /* and add -l<lib name> */
-    if (!strncmp(laBase, "lib", 3)) laBase += 3;
-    ORL(aarg, malloc, NULL, (strlen(laBase) + 3));
-    sprintf(aarg, "-l%s", laBase);
-    WRITE_BUFFER(*outCmd, aarg);
-    WRITE_BUFFER(*tofree, aarg);
+/* a .la named on the command line, and where it goes in the command */
+struct LaRoot {
+    size_t node, pos;
+};
 
-    if (wholeArchive) {
-        WRITE_BUFFER(*outCmd, "-Wl,--no-whole-archive");
-    }
+struct LaGraph {
+    struct LaNode *nodes;
+    size_t nodesUsed, nodesSz;
 
-    free(laBaseC);
-    free(laDirC);
+    /* an index from paths (as referenced, and real) to node indices + 1 */
+    char **indexKeys;
+    size_t *indexNodes;
+    size_t indexUsed, indexSz;
 
-    /* then add any dependencies */
-    f = fopen(arg, "r");
-    if (f) {
-        char *lbuf;
-        size_t lbufsz, lbufused;
-        lbufsz = 32;
-        ORL(lbuf, malloc, NULL, (lbufsz));
-
-        while (fgets(lbuf, lbufsz, f)) {
-            lbufused = strlen(lbuf);
-
-            /* read in the remainder of the line */
-            while (lbuf[lbufused-1] != '\n') {
-                lbufsz *= 2;
-                ORL(lbuf, realloc, NULL, (lbuf, lbufsz));
-                if (!fgets(lbuf + lbufused, lbufsz - lbufused, f)) break;
-                lbufused = strlen(lbuf);
-            }
-
-            /* is this a dependency_libs line? */
-            if (!strncmp(lbuf, "dependency_libs='", 17)) {
-                char *part, *saveptr;
-                char *dlibs = lbuf + 17;
-                char *end = strrchr(dlibs, '\'');
-                if (end) *end = '\0';
+    struct LaRoot *roots;
+    size_t rootsUsed, rootsSz;
+};
 
-                /* now go one by one through the libs */
-                part = strtok_r(dlibs, " ", &saveptr);
-                while (part) {
-                    /* if this is a .la file, need to recurse */
-                    char *ext = strrchr(part, '.');
-                    if (ext && !strcmp(ext, ".la")) {
-                        linkLaFile(opt, buildLib, outCmd, libDirs, NULL, tofree, part);
-
-                    } else {
-                        /* otherwise, just add it */
-                        char *pdup;
-                        ORL(pdup, strdup, NULL, (part));
-                        WRITE_BUFFER(*outCmd, pdup);
-                        WRITE_BUFFER(*tofree, pdup);
+/* Find the slot for a path in the graph's index */
+static size_t laIndexSlot(struct LaGraph *graph, const char *path)
+{
+    size_t i = hashStr(path) & (graph->indexSz - 1);
+    while (graph->indexKeys[i] && strcmp(graph->indexKeys[i], path))
+        i = (i + 1) & (graph->indexSz - 1);
+    return i;
+}
 
-                    }
+/* Look up a path in the graph, returning the node index + 1 or 0 */
+static size_t laIndexGet(struct LaGraph *graph, const char *path)
+{
+    size_t i;
+    if (!graph->indexUsed) return 0;
+    i = laIndexSlot(graph, path);
+    return graph->indexKeys[i] ? graph->indexNodes[i] : 0;
+}
 
-                    part = strtok_r(NULL, " ", &saveptr);
-                }
+/* Add a path to the graph's index */
+static void laIndexPut(struct Options *opt, struct LaGraph *graph,
+                       const char *path, size_t node)
+{
+    size_t i;
+
+    /* keep the index at most half full */
+    if ((graph->indexUsed + 1) * 2 > graph->indexSz) {
+        char **oldKeys = graph->indexKeys;
+        size_t *oldNodes = graph->indexNodes;
+        size_t oldSz = graph->indexSz;
+
+        graph->indexSz = oldSz ? oldSz * 2 : 64;
+        ORL(graph->indexKeys, calloc, NULL, (graph->indexSz, sizeof(char *)));
+        ORL(graph->indexNodes, calloc, NULL, (graph->indexSz, sizeof(size_t)));
+        for (i = 0; i < oldSz; i++) {
+            if (oldKeys[i]) {
+                size_t j = laIndexSlot(graph, oldKeys[i]);
+                graph->indexKeys[j] = oldKeys[i];
+                graph->indexNodes[j] = oldNodes[i];
             }
         }
-
-        free(lbuf);
-        fclose(f);
+        free(oldKeys);
+        free(oldNodes);
     }
 
+    i = laIndexSlot(graph, path);
+    if (!graph->indexKeys[i]) {
+        graph->indexKeys[i] = arenaStrdup(opt, path);
+        graph->indexUsed++;
+    }
+    graph->indexNodes[i] = node + 1;
 }
 
-static void ltlink(struct Options *opt)
+/* Make a new node for a .la file */
+static size_t laGraphNewNode(struct Options *opt,
+                             int buildLib,
+                             struct LaGraph *graph,
+                             char *path,
+                             int hasSo)
 {
-    struct Buffer outCmd, outAr, libDirs, dependencyLibs, tofree;
-    size_t i;
-    char *ext;
-    int tmpi;
+    struct LaNode *node;
+    char *laBase;
+    size_t ni;
+
+    GROW_ARRAY(opt, graph->nodes, graph->nodesUsed, graph->nodesSz);
+    ni = graph->nodesUsed++;
+    node = &graph->nodes[ni];
+    memset(node, 0, sizeof(struct LaNode));
+    INIT_BUFFER(node->flags);
+    node->path = path;
+    laIndexPut(opt, graph, path, ni);
+
+    /* figure out the .libs name */
+    node->dir = arenaDirname(opt, path);
+    laBase = arenaBasename(opt, path, 1);
 
-    /* options */
-    int major = 0,
-        minor = 0,
-        revision = 0,
-        module = 0,
-        avoidVersion = 0,
-        rpathSpecified = 0,
-        insane = 0;
-    char *outName = NULL,
-         *rpath = NULL;
-    size_t outNamePos = 0;
+    /* if there's only a .a, libtool specifies we bring in the whole archive */
+    if (buildLib) {
+        if (hasSo < 0)
+            hasSo = (access(arenaLibsPath(opt, node->dir, laBase, ".so"), F_OK) == 0);
+        if (!hasSo)
+            node->wholeArchive = 1;
+    }
 
-    /* option derivatives */
-    int buildBinary = 0,
-        buildLib = 0,
-        buildSo = 0,
-        buildA = 0,
-        buildPicA = 0;
-    char *outDirC = NULL,
-         *outDir = NULL,
-         *libsDir = NULL,
-         *outBaseC = NULL,
-         *outBase = NULL,
-         *afile = NULL,
-         *soname = NULL,
-         *longname = NULL,
-         *linkname = NULL;
+    /* get the -l name */
+    if (!strncmp(laBase, "lib", 3)) laBase += 3;
+    node->name = laBase;
 
+    return ni;
+}
 
-    /* before we can even start, we have to figure out what we're building to
-     * know whether to build the command out of static .o or pic .o files */
-    for (i = 1; opt->cmd[i]; i++) {
-        if (opt->cmd[i+1]) {
-            if (!strcmp(opt->cmd[i], "-o"))
-                outName = opt->cmd[i+1];
-            else if (!strcmp(opt->cmd[i], "-rpath"))
-                rpathSpecified = 1;
-        }
-    }
+/* The name of the closure index for a .la file */
+static char *laClosureName(struct Options *opt, const char *laFile)
+{
+    return arenaLibsPath(opt, arenaDirname(opt, laFile),
+                         arenaBasename(opt, laFile, 1), ".closure");
+}
 
-    if (outName) {
-        ext = strrchr(outName, '.');
-        if (ext && !strcmp(ext, ".la")) {
-            /* it's a libtool library */
-            buildLib = 1;
-            buildA = opt->buildStatic;
+/* Load a .la file's closure index into the graph. Returns the node index, or
+ * (size_t) -1 if there's no up-to-date index. */
+static size_t laGraphLoadIndex(struct Options *opt,
+                               int buildLib,
+                               struct LaGraph *graph,
+                               char *path,
+                               const char *real)
+{
+    char *indexName, *buf, *line, *next;
+    size_t *map = NULL, mapUsed = 0, mapSz = 0;
+    size_t *fresh = NULL;
+    size_t i, ret = (size_t) -1;
+    struct Buffer paths, sos;
+    struct stat sb;
+    ssize_t rd;
+    int fd;
 
-        } else {
-            /* it's a binary */
-            buildBinary = 1;
+    indexName = laClosureName(opt, path);
+    fd = open(indexName, O_RDONLY);
+    if (fd < 0) return ret;
 
+    /* read it all at once */
+    if (fstat(fd, &sb) != 0 || sb.st_size <= 0) {
+        close(fd);
+        return ret;
+    }
+    buf = arenaAlloc(opt, sb.st_size + 1);
+    rd = read(fd, buf, sb.st_size);
+    close(fd);
+    if (rd != sb.st_size || strncmp(buf, CLOSURE_HEADER, sizeof(CLOSURE_HEADER) - 1))
+        return ret;
+    buf[rd] = '\0';
+
+    /* first check that every node is up to date */
+    INIT_BUFFER(paths);
+    INIT_BUFFER(sos);
+    for (line = buf + sizeof(CLOSURE_HEADER) - 1; *line; line = next) {
+        long long mtime, size;
+        int so, pos;
+
+        next = strchr(line, '\n');
+        if (!next) goto out; /* truncated */
+        *next++ = '\0';
+        if (line[0] != 'n') continue;
+
+        if (sscanf(line, "n %lld %lld %d %n", &mtime, &size, &so, &pos) < 3 ||
+            stat(line + pos, &sb) != 0 ||
+            (long long) sb.st_mtime != mtime ||
+            (long long) sb.st_size != size)
+            goto out;
+        if (!paths.bufused && strcmp(line + pos, real))
+            goto out; /* the index isn't for this .la */
+
+        WRITE_BUFFER(paths, line + pos);
+        WRITE_BUFFER(sos, so ? "" : NULL);
+    }
+    if (!paths.bufused) goto out;
+
+    /* it's good, so it becomes part of the graph */
+    ORL(fresh, calloc, NULL, (paths.bufused, sizeof(size_t)));
+    for (i = 0; i < paths.bufused; i++) {
+        size_t ni = laIndexGet(graph, paths.buf[i]);
+        GROW_ARRAY(opt, map, mapUsed, mapSz);
+        if (ni) {
+            map[mapUsed++] = ni - 1;
+        } else {
+            ni = laGraphNewNode(opt, buildLib, graph,
+                                i ? paths.buf[i] : path, sos.buf[i] != NULL);
+            if (!i) laIndexPut(opt, graph, paths.buf[0], ni);
+            map[mapUsed++] = ni;
+            fresh[i] = 1;
         }
     }
 
-    /* should we build a .so? */
-    if (buildLib) {
-        if (rpathSpecified) {
-            buildSo = opt->buildShared;
-        } else {
-            buildA = 1;
-            buildPicA = 1;
+    /* then the edges and flags of the new nodes */
+    for (line = buf + sizeof(CLOSURE_HEADER) - 1; *line; line += strlen(line) + 1) {
+        unsigned long from, to;
+        int pos;
+        struct LaNode *node;
+
+        if (line[0] == 'd' &&
+            sscanf(line, "d %lu %lu", &from, &to) == 2 &&
+            from < mapUsed && to < mapUsed && fresh[from]) {
+            node = &graph->nodes[map[from]];
+            GROW_ARRAY(opt, node->deps, node->depsUsed, node->depsSz);
+            node->deps[node->depsUsed++] = map[to];
+
+        } else if (line[0] == 'f' &&
+                   sscanf(line, "f %lu %n", &from, &pos) >= 1 &&
+                   from < mapUsed && fresh[from]) {
+            node = &graph->nodes[map[from]];
+            WRITE_BUFFER(node->flags, line + pos);
+
         }
     }
 
-    /* allocate our buffers */
-    INIT_BUFFER(outCmd);
-    INIT_BUFFER(outAr);
-    INIT_BUFFER(libDirs);
-    INIT_BUFFER(dependencyLibs);
-    INIT_BUFFER(tofree);
+    ret = map[0];
 
-    WRITE_BUFFER(outCmd, opt->cmd[0]);
-    WRITE_BUFFER(outAr, "ar");
-    WRITE_BUFFER(outAr, "rc");
-    WRITE_BUFFER(outAr, "a.a"); /* to be replaced */
+out:
+    free(map);
+    free(fresh);
+    FREE_BUFFER(sos);
+    FREE_BUFFER(paths);
+    return ret;
+}
 
-    /* `pwd`/.libs is always in -L */
-    WRITE_BUFFER(outCmd, "-L.libs");
-    addLibDir(opt, &libDirs, &tofree, ".libs");
+/* Get the node for a .la file, reading it (and everything it depends on) if
+ * it's not already in the graph */
+static size_t laGraphNode(struct Options *opt,
+                          int buildLib,
+                          struct LaGraph *graph,
+                          char *path)
+{
+    struct LaNode *node;
+    char *real, *ext, *dlibs;
+    size_t ni;
+
+    /* maybe we already have it, by this path or its real path */
+    if ((ni = laIndexGet(graph, path))) return ni - 1;
+    real = realpath(path, NULL);
+    if (real && (ni = laIndexGet(graph, real))) {
+        laIndexPut(opt, graph, path, ni - 1);
+        free(real);
+        return ni - 1;
+    }
 
-    /* read in the command */
-    for (i = 1; opt->cmd[i]; i++) {
-        char *arg = opt->cmd[i];
-        char *narg = opt->cmd[i+1];
+    /* or it may have an index of everything it needs */
+    if (real && (ni = laGraphLoadIndex(opt, buildLib, graph, path, real)) != (size_t) -1) {
+        free(real);
+        return ni;
+    }
 
-        if (arg[0] == '-') {
-            if (!strcmp(arg, "-all-static")) {
-                WRITE_BUFFER(outCmd, "-static");
+    /* make a new node */
+    ni = laGraphNewNode(opt, buildLib, graph, path, -1);
+    if (real) {
+        laIndexPut(opt, graph, real, ni);
+        free(real);
+    }
 
-            } else if (!strcmp(arg, "-avoid-version")) {
-                avoidVersion = 1;
+    /* then read its dependencies */
+    dlibs = laDependencyLibs(opt, path);
+    if (dlibs) {
+        char *part, *saveptr;
+
+        /* go one by one through the libs */
+        part = strtok_r(dlibs, " ", &saveptr);
+        while (part) {
+            ext = strrchr(part, '.');
+            if (ext && !strcmp(ext, ".la")) {
+                /* another node, note that node may move */
+                size_t dep = laGraphNode(opt, buildLib, graph, part);
+                node = &graph->nodes[ni];
+                GROW_ARRAY(opt, node->deps, node->depsUsed, node->depsSz);
+                node->deps[node->depsUsed++] = dep;
 
-            } else if (!strcmp(arg, "-export-dynamic")) {
-                WRITE_BUFFER(outCmd, "-rdynamic");
+            } else {
+                /* otherwise, just link it with this library */
+                node = &graph->nodes[ni];
+                WRITE_BUFFER(node->flags, part);
 
-            } else if (!strncmp(arg, "-L", 2)) {
-                char *llibs;
+            }
 
-                /* need both the -L path specified and .../.libs */
-                WRITE_BUFFER(outCmd, arg);
-                WRITE_BUFFER(dependencyLibs, arg);
-                addLibDir(opt, &libDirs, &tofree, arg + 2);
+            part = strtok_r(NULL, " ", &saveptr);
+        }
+    }
 
-                ORL(llibs, malloc, NULL, (strlen(arg) + 7));
-                sprintf(llibs, "%s/.libs", arg);
+    return ni;
+}
 
-                WRITE_BUFFER(outCmd, llibs);
-                WRITE_BUFFER(dependencyLibs, llibs);
-                WRITE_BUFFER(tofree, llibs);
-                addLibDir(opt, &libDirs, &tofree, llibs + 2);
+/* Add a .la from the command line, leaving a placeholder in the command */
+static void laGraphAddRoot(struct Options *opt,
+                           int buildLib,
+                           struct LaGraph *graph,
+                           struct Buffer *outCmd,
+                           struct Buffer *dependencyLibs,
+                           char *arg)
+{
+    size_t ni = laGraphNode(opt, buildLib, graph, arg);
+
+    GROW_ARRAY(opt, graph->roots, graph->rootsUsed, graph->rootsSz);
+    graph->roots[graph->rootsUsed].node = ni;
+    graph->roots[graph->rootsUsed].pos = outCmd->bufused;
+    graph->rootsUsed++;
+    WRITE_BUFFER(*outCmd, arg);
+
+    /* if we're not linking in the whole archive, then this becomes a
+     * dependency */
+    if (!graph->nodes[ni].wholeArchive) {
+        char *realla = arenaRealpath(opt, arg);
+        WRITE_BUFFER(*dependencyLibs, realla ? realla : arg);
+    }
+}
 
-            } else if (!strncmp(arg, "-l", 2)) {
-                WRITE_BUFFER(outCmd, arg);
-                WRITE_BUFFER(dependencyLibs, arg);
+/* Find the closure of a node, in reverse topological order (dependencies
+ * first) */
+static void laGraphClosure(struct Options *opt, struct LaGraph *graph,
+                           size_t ni, int mark, struct Buffer *closure)
+{
+    struct LaNode *node = &graph->nodes[ni];
+    size_t i;
 
-            } else if (!strcmp(arg, "-module")) {
-                module = 1;
+    if (node->mark == mark) return;
+    node->mark = mark;
+    for (i = 0; i < node->depsUsed; i++)
+        laGraphClosure(opt, graph, node->deps[i], mark, closure);
+    WRITE_BUFFER(*closure, (char *) (graph->nodes + ni));
+}
 
-            } else if (!strcmp(arg, "-o") && narg) {
-                WRITE_BUFFER(outCmd, arg);
-                outNamePos = outCmd.bufused;
-                WRITE_BUFFER(outCmd, narg);
-                i++;
+/* Replace the placeholders in the command with the libraries. Each library
+ * goes in the last place it's needed, and before everything it depends on.
+ * Updates *outNamePos to match the new command. */
+static void laGraphExpand(struct Options *opt,
+                          struct LaGraph *graph,
+                          struct Buffer *outCmd,
+                          size_t *outNamePos,
+                          struct Buffer *libDirs)
+{
+    struct Buffer *closures, newCmd, libsFlags;
+    size_t i, j, k, ri;
+
+    if (!graph->rootsUsed) return;
+
+    /* find each root's closure, and the last root needing each node */
+    ORL(closures, calloc, NULL, (graph->rootsUsed, sizeof(struct Buffer)));
+    for (ri = 0; ri < graph->rootsUsed; ri++) {
+        INIT_BUFFER(closures[ri]);
+        laGraphClosure(opt, graph, graph->roots[ri].node, ri + 1, &closures[ri]);
+        for (j = 0; j < closures[ri].bufused; j++)
+            ((struct LaNode *) closures[ri].buf[j])->last = ri;
+    }
 
-            } else if (!strcmp(arg, "-rpath") && narg) {
-                rpath = narg;
-                i++;
+    /* then build the new command */
+    INIT_BUFFER(newCmd);
+    INIT_BUFFER(libsFlags);
+    ri = 0;
+    for (i = 0; i < outCmd->bufused; i++) {
+        if (i == *outNamePos) {
+            *outNamePos = newCmd.bufused;
+            WRITE_BUFFER(newCmd, outCmd->buf[i]);
+            continue;
+        }
+        if (ri >= graph->rootsUsed || i != graph->roots[ri].pos) {
+            WRITE_BUFFER(newCmd, outCmd->buf[i]);
+            continue;
+        }
 
-            } else if (!strcmp(arg, "-version-info") && narg) {
-                /* current:revision:age instead of major.minor.revision */
-                int current = 0;
-                revision = 0;
+        /* expand this root, from the top */
+        for (j = closures[ri].bufused; j > 0; j--) {
+            struct LaNode *node = (struct LaNode *) closures[ri].buf[j-1];
+            char *aarg;
+
+            if (node->last != ri) continue;
+
+            /* add -L for the .libs path, once */
+            for (k = 0; k < libsFlags.bufused; k++)
+                if (!strcmp(libsFlags.buf[k], node->dir)) break;
+            if (k == libsFlags.bufused) {
+                aarg = arenaPrintf(opt, "-L%s/.libs", node->dir);
+                WRITE_BUFFER(libsFlags, node->dir);
+                WRITE_BUFFER(newCmd, aarg);
+                addLibDir(opt, libDirs, aarg + 2);
+            }
 
-                /* if the format fails in any way, just use 0 */
-                sscanf(narg, "%d:%d:%d", &current, &revision, &minor);
-                if (minor > current) minor = current;
-                major = current - minor;
+            if (node->wholeArchive) {
+                /* this is GNU-ld-specific, so retry if it doesn't work */
+                opt->retryIfFail = 1;
+                WRITE_BUFFER(newCmd, "-Wl,--whole-archive");
+            }
 
-                i++;
+            /* and add -l<lib name> */
+            WRITE_BUFFER(newCmd, arenaPrintf(opt, "-l%s", node->name));
 
-            } else if (!strncmp(arg, "-Wc,", 4)) {
-                WRITE_BUFFER(outCmd, arg + 4);
+            if (node->wholeArchive)
+                WRITE_BUFFER(newCmd, "-Wl,--no-whole-archive");
 
-            } else if (narg &&
-                       (!strcmp(arg, "-Xcompiler") ||
-                        !strcmp(arg, "-XCClinker"))) {
-                WRITE_BUFFER(outCmd, narg);
-                i++;
+            /* and its other dependencies */
+            for (k = 0; k < node->flags.bufused; k++)
+                WRITE_BUFFER(newCmd, node->flags.buf[k]);
+        }
 
-            } else if (!strcmp(arg, "-dlopen") ||
-                       !strcmp(arg, "-dlpreopen") ||
-                       !strcmp(arg, "-export-symbols") ||
-                       !strcmp(arg, "-export-symbols-regex") ||
-                       !strcmp(arg, "-objectlist") ||
-                       !strcmp(arg, "-precious-files-regex") ||
-                       !strcmp(arg, "-release") ||
-                       !strcmp(arg, "-shared") ||
-                       !strcmp(arg, "-shrext") ||
-                       !strcmp(arg, "-static") ||
-                       !strcmp(arg, "-static-libtool-libs") ||
-                       !strcmp(arg, "-weak")) {
-                /* unsupported */
-                insane = 1;
+        ri++;
+    }
 
-            } else if (!strcmp(arg, "-bindir") && narg) {
-                /* ignored for compatibility */
-                i++;
+    /* and replace the old command */
+    FREE_BUFFER(*outCmd);
+    *outCmd = newCmd;
 
-            } else if (!strcmp(arg, "-no-fast-install") ||
-                       !strcmp(arg, "-no-install") ||
-                       !strcmp(arg, "-no-undefined")) {
-                /* ignored for compatibility */
+    FREE_BUFFER(libsFlags);
+    for (ri = 0; ri < graph->rootsUsed; ri++)
+        FREE_BUFFER(closures[ri]);
+    free(closures);
+}
 
-            } else {
-                WRITE_BUFFER(outCmd, arg);
+/* Write the closure index for the .la we just made, so that anything linking
+ * to it can skip reading the whole tree of .la files. The .la itself is
+ * always node 0. */
+static void laGraphWriteIndex(struct Options *opt,
+                              struct LaGraph *graph,
+                              char *outName,
+                              struct Buffer *dependencyLibs,
+                              int hasSo)
+{
+    struct Buffer closure, selfDeps;
+    char *indexName, *tmpName, *real;
+    struct stat sb;
+    size_t i, j;
+    int mark = (int) graph->rootsUsed + 1;
+    FILE *f;
 
-            }
+    if (opt->dryRun) return;
+    if (stat(outName, &sb) != 0 || !(real = realpath(outName, NULL)))
+        return;
 
-        } else {
-            ext = strrchr(arg, '.');
-            if (ext && !strcmp(ext, ".lo")) {
-                /* make separate versions for the .a and the .so */
-                char *loDirC, *loDir, *loBaseC, *loBase, *loPic, *loNonPic;
+    /* find everything our dependency_libs need */
+    INIT_BUFFER(closure);
+    INIT_BUFFER(selfDeps);
+    for (i = 0; i < dependencyLibs->bufused; i++) {
+        char *ext = strrchr(dependencyLibs->buf[i], '.');
+        size_t ni;
+        if (ext && !strcmp(ext, ".la") &&
+            (ni = laIndexGet(graph, dependencyLibs->buf[i]))) {
+            WRITE_BUFFER(selfDeps, (char *) (graph->nodes + ni - 1));
+            laGraphClosure(opt, graph, ni - 1, mark, &closure);
+        }
+    }
+    for (i = 0; i < closure.bufused; i++)
+        ((struct LaNode *) closure.buf[i])->id = i + 1;
+
+    indexName = laClosureName(opt, outName);
+    tmpName = arenaPrintf(opt, "%s.%d", indexName, (int) getpid());
+    f = fopen(tmpName, "w");
+    if (!f) goto out;
+
+    fputs(CLOSURE_HEADER, f);
+
+    /* the nodes */
+    fprintf(f, "n %lld %lld %d %s\n", (long long) sb.st_mtime,
+            (long long) sb.st_size, hasSo, real);
+    for (i = 0; i < closure.bufused; i++) {
+        struct LaNode *node = (struct LaNode *) closure.buf[i];
+        char *nodeReal = realpath(node->path, NULL);
+        if (!nodeReal || stat(nodeReal, &sb) != 0) {
+            free(nodeReal);
+            fclose(f);
+            unlink(tmpName);
+            goto out;
+        }
+        fprintf(f, "n %lld %lld %d %s\n", (long long) sb.st_mtime,
+                (long long) sb.st_size, !node->wholeArchive, nodeReal);
+        free(nodeReal);
+    }
 
-                /* OK, it's a .lo file, figure out the .libs name */
-                ORL(loDirC, strdup, NULL, (arg));
-                loDir = dirname(loDirC);
-                ORL(loBaseC, strdup, NULL, (arg));
-                loBase = basename(loBaseC);
+    /* the edges and flags */
+    for (i = 0; i < dependencyLibs->bufused; i++) {
+        char *ext = strrchr(dependencyLibs->buf[i], '.');
+        if (!ext || strcmp(ext, ".la"))
+            fprintf(f, "f 0 %s\n", dependencyLibs->buf[i]);
+    }
+    for (i = 0; i < selfDeps.bufused; i++)
+        fprintf(f, "d 0 %lu\n", (unsigned long) ((struct LaNode *) selfDeps.buf[i])->id);
+    for (i = 0; i < closure.bufused; i++) {
+        struct LaNode *node = (struct LaNode *) closure.buf[i];
+        for (j = 0; j < node->depsUsed; j++)
+            fprintf(f, "d %lu %lu\n", (unsigned long) node->id,
+                    (unsigned long) graph->nodes[node->deps[j]].id);
+        for (j = 0; j < node->flags.bufused; j++)
+            fprintf(f, "f %lu %s\n", (unsigned long) node->id, node->flags.buf[j]);
+    }
 
-                ext = strrchr(loBase, '.');
-                if (ext) *ext = '\0';
+    if (fclose(f) != 0 || rename(tmpName, indexName) != 0)
+        unlink(tmpName);
 
-                /* make the .libs/.o version */
-                ORL(loPic, malloc, NULL, (strlen(loDir) + strlen(loBase) + 10));
-                sprintf(loPic, "%s/.libs/%s.o", loDir, loBase);
-                ORL(loNonPic, malloc, NULL, (strlen(loDir) + strlen(loBase) + 4));
-                sprintf(loNonPic, "%s/%s.o", loDir, loBase);
+out:
+    free(real);
+    FREE_BUFFER(selfDeps);
+    FREE_BUFFER(closure);
+}
 
-                /* which .o we choose depends on a complexicon of situations */
-                if (buildPicA)
-                    WRITE_BUFFER(outAr, loPic);
-                else
-                    WRITE_BUFFER(outAr, loNonPic);
-                if (buildBinary)
-                    WRITE_BUFFER(outCmd, loNonPic);
-                else
-                    WRITE_BUFFER(outCmd, loPic);
+/* Free a .la graph */
+static void laGraphFree(struct LaGraph *graph)
+{
+    size_t i;
+    for (i = 0; i < graph->nodesUsed; i++) {
+        free(graph->nodes[i].deps);
+        FREE_BUFFER(graph->nodes[i].flags);
+    }
+    free(graph->nodes);
+    free(graph->indexKeys);
+    free(graph->indexNodes);
+    free(graph->roots);
+}
 
-                WRITE_BUFFER(tofree, loPic);
-                WRITE_BUFFER(tofree, loNonPic);
+/* Static archives are written directly, in the GNU format: a symbol index
+ * ("/"), a table of long member names ("//"), then the members. The symbol
+ * index is read out of the ELF symbol tables of the members, so anything that
+ * isn't a plain ELF object (e.g. LTO bytecode) is left to the real ar. */
+
+/* a member of an archive we're replacing */
+struct ArOldMember {
+    const char *name;
+    unsigned long long hdr, size; /* offset of its header, and its size */
+    long long mtime;
+    long uid, gid;
+    unsigned long mode;
+    size_t firstSym, symCount; /* its symbols in the old index */
+    int used;
+};
 
-                free(loBaseC);
-                free(loDirC);
+/* an archive we're replacing */
+struct ArOld {
+    int fd;
+    unsigned char *map;
+    size_t sz;
+    struct ArOldMember *members;
+    size_t membersUsed, membersSz;
+    const char **syms; /* grouped by member */
+    size_t symsUsed;
+    size_t next; /* where to look for the next member */
+    struct timespec mtim;
+    int thin;
+};
 
-            } else if (ext && !strcmp(ext, ".la")) {
-                linkLaFile(opt, buildLib, &outCmd, &libDirs, &dependencyLibs, &tofree, arg);
+/* a member of an archive being written */
+struct ArMember {
+    const char *path, *name;
+    struct stat sb;
+    long longName; /* offset in the long name table, or -1 */
+    unsigned long long offset; /* of its header in the archive */
+    struct ArOldMember *old; /* the same member in the old archive */
+};
 
-            } else {
-                WRITE_BUFFER(outAr, arg);
-                WRITE_BUFFER(outCmd, arg);
+/* a symbol in an archive's index */
+struct ArSymbol {
+    const char *name;
+    size_t member;
+};
 
-            }
+struct ArWriter {
+    struct ArMember *members;
+    size_t membersUsed, membersSz;
+    struct ArSymbol *symbols;
+    size_t symbolsUsed, symbolsSz;
+};
+
+/* read an n-byte ELF integer */
+static unsigned long long elfInt(const unsigned char *p, int n, int bigEndian)
+{
+    unsigned long long ret = 0;
+    int i;
+    for (i = 0; i < n; i++)
+        ret = (ret << 8) | p[bigEndian ? i : n - 1 - i];
+    return ret;
+}
+
+/* read a numeric archive header field */
+static unsigned long long arField(const unsigned char *p, int len, int base)
+{
+    char buf[17];
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    return strtoull(buf, NULL, base);
+}
 
+/* Free an old archive */
+static void arFreeOld(struct ArOld *old)
+{
+    if (old->map) munmap(old->map, old->sz);
+    if (old->fd >= 0) close(old->fd);
+    free(old->members);
+    free(old->syms);
+    memset(old, 0, sizeof(struct ArOld));
+    old->fd = -1;
+}
+
+/* Add the global symbols defined in an ELF object to the index. Returns -1 if
+ * this isn't an ELF relocatable object we understand. */
+static int arReadSymbols(struct Options *opt, struct ArWriter *ar, size_t member,
+                         const unsigned char *obj, size_t sz)
+{
+    int is64, be;
+    unsigned long long shoff, shentsize, shnum, shstrndx;
+    unsigned long long i, j;
+    const unsigned char *shstr = NULL;
+    unsigned long long shstrSz = 0;
+
+#define ELF_INT(p, n) elfInt((p), (n), be)
+#define SH(i) (obj + shoff + (i) * shentsize)
+#define SH_FIELD(sh, off32, off64, n32, n64) \
+    (is64 ? ELF_INT((sh) + (off64), (n64)) : ELF_INT((sh) + (off32), (n32)))
+#define SH_NAME(sh) ELF_INT((sh), 4)
+#define SH_TYPE(sh) ELF_INT((sh) + 4, 4)
+#define SH_OFFSET(sh) SH_FIELD(sh, 16, 24, 4, 8)
+#define SH_SIZE(sh) SH_FIELD(sh, 20, 32, 4, 8)
+#define SH_LINK(sh) SH_FIELD(sh, 24, 40, 4, 4)
+#define SH_ENTSIZE(sh) SH_FIELD(sh, 36, 56, 4, 8)
+#define IN_OBJ(off, len) ((off) <= sz && (len) <= sz - (off))
+
+    if (sz < 64 || memcmp(obj, "\177ELF", 4)) return -1;
+    if (obj[4] != 1 && obj[4] != 2) return -1;
+    if (obj[5] != 1 && obj[5] != 2) return -1;
+    is64 = (obj[4] == 2);
+    be = (obj[5] == 2);
+    if (ELF_INT(obj + 16, 2) != 1 /* ET_REL */) return -1;
+
+    if (is64) {
+        shoff = ELF_INT(obj + 40, 8);
+        shentsize = ELF_INT(obj + 58, 2);
+        shnum = ELF_INT(obj + 60, 2);
+        shstrndx = ELF_INT(obj + 62, 2);
+    } else {
+        shoff = ELF_INT(obj + 32, 4);
+        shentsize = ELF_INT(obj + 46, 2);
+        shnum = ELF_INT(obj + 48, 2);
+        shstrndx = ELF_INT(obj + 50, 2);
+    }
+    if (shentsize < (is64 ? 64 : 40) || !IN_OBJ(shoff, shentsize)) return -1;
+
+    /* lots of sections are counted in section 0 */
+    if (shnum == 0) shnum = SH_SIZE(SH(0));
+    if (shstrndx == 0xffff) shstrndx = SH_LINK(SH(0));
+    if (shnum > sz / shentsize || !IN_OBJ(shoff, shnum * shentsize)) return -1;
+
+    if (shstrndx < shnum) {
+        const unsigned char *sh = SH(shstrndx);
+        if (IN_OBJ(SH_OFFSET(sh), SH_SIZE(sh))) {
+            shstr = obj + SH_OFFSET(sh);
+            shstrSz = SH_SIZE(sh);
         }
     }
 
-    if (insane) {
-        /* just go to libtool */
-        execLibtool(opt);
+    /* LTO objects' real symbols aren't in the symbol table */
+    for (i = 0; shstr && i < shnum; i++) {
+        unsigned long long name = SH_NAME(SH(i));
+        if (name < shstrSz &&
+            (!strncmp((const char *) shstr + name, ".gnu.lto_", 9) ||
+             !strncmp((const char *) shstr + name, ".llvm.lto", 9)))
+            return -1;
     }
 
-    /* make sure an output name was specified */
-    if (!outName) {
-        outName = "a.out";
-        buildBinary = 1;
-        WRITE_BUFFER(outCmd, "-o");
-        outNamePos = outCmd.bufused;
-        WRITE_BUFFER(outCmd, outName);
+    for (i = 0; i < shnum; i++) {
+        const unsigned char *sh = SH(i), *strtab, *syms;
+        unsigned long long symsSz, symEnt, strSz, link;
+
+        if (SH_TYPE(sh) != 2 /* SHT_SYMTAB */) continue;
+        syms = obj + SH_OFFSET(sh);
+        symsSz = SH_SIZE(sh);
+        symEnt = SH_ENTSIZE(sh);
+        link = SH_LINK(sh);
+        if (symEnt < (is64 ? 24 : 16) || link >= shnum ||
+            !IN_OBJ(SH_OFFSET(sh), symsSz))
+            return -1;
+        strtab = obj + SH_OFFSET(SH(link));
+        strSz = SH_SIZE(SH(link));
+        if (!IN_OBJ(SH_OFFSET(SH(link)), strSz))
+            return -1;
+
+        for (j = symEnt; j + symEnt <= symsSz; j += symEnt) {
+            const unsigned char *sym = syms + j;
+            unsigned long long name = ELF_INT(sym, 4);
+            int info = is64 ? sym[4] : sym[12];
+            int shndx = (int) ELF_INT(sym + (is64 ? 6 : 14), 2);
+            int bind = info >> 4, type = info & 0xf;
+
+            /* only defined globals (including commons) go in the index */
+            if (bind != 1 /* GLOBAL */ && bind != 2 /* WEAK */ &&
+                bind != 10 /* GNU_UNIQUE */)
+                continue;
+            if (shndx == 0 /* SHN_UNDEF */ || type == 3 /* STT_SECTION */ ||
+                type == 4 /* STT_FILE */)
+                continue;
+            if (name == 0 || name >= strSz ||
+                !memchr(strtab + name, '\0', strSz - name))
+                continue;
+
+            GROW_ARRAY(opt, ar->symbols, ar->symbolsUsed, ar->symbolsSz);
+            ar->symbols[ar->symbolsUsed].name =
+                arenaStrdup(opt, (const char *) strtab + name);
+            ar->symbols[ar->symbolsUsed].member = member;
+            ar->symbolsUsed++;
+        }
     }
 
-    /* get the directory names */
-    ORL(outDirC, strdup, NULL, (outName));
-    outDir = dirname(outDirC);
-    ORL(outBaseC, strdup, NULL, (outName));
-    outBase = basename(outBaseC);
-
-    /* make the .libs dir */
-    ORL(libsDir, malloc, NULL, (strlen(outDir) + 7));
-    sprintf(libsDir, "%s/.libs", outDir);
-    if (!opt->dryRun) mkdir(libsDir, 0777); /* ignore errors */
-
-    /* building a binary involves making a wrapper */
-    if (buildBinary) {
-        char *realName;
-
-        ORL(realName, malloc, NULL, (strlen(outDir) + strlen(outBase) + 8));
-        sprintf(realName, "%s/.libs/%s", outDir, outBase);
+#undef IN_OBJ
+#undef SH_ENTSIZE
+#undef SH_LINK
+#undef SH_SIZE
+#undef SH_OFFSET
+#undef SH_TYPE
+#undef SH_NAME
+#undef SH_FIELD
+#undef SH
+#undef ELF_INT
 
-        /* do the actual build */
-        outCmd.buf[outNamePos] = realName;
-        WRITE_BUFFER(outCmd, NULL);
-        spawn(opt, outCmd.buf);
-        outCmd.bufused--;
+    return 0;
+}
 
-        /* then make the wrapper */
-        if (!opt->dryRun) {
-            char *absName;
-            FILE *f;
+/* Read the archive we're about to replace, so that its unchanged members
+ * (and their symbols) can be reused. Returns -1 if there's nothing usable. */
+static int arReadOld(struct Options *opt, struct ArOld *old, const char *path)
+{
+    const unsigned char *index = NULL, *longNames = NULL;
+    unsigned long long pos, indexSz = 0, longSz = 0, count, i;
+    struct ArOldMember *om;
+    const char **syms;
+    struct stat sb;
+
+    memset(old, 0, sizeof(struct ArOld));
+    if ((old->fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(old->fd, &sb) != 0 || sb.st_size < 8)
+        goto fail;
+    old->sz = sb.st_size;
+    old->mtim = sb.st_mtim;
+    old->map = mmap(NULL, old->sz, PROT_READ, MAP_PRIVATE, old->fd, 0);
+    if (old->map == MAP_FAILED) {
+        old->map = NULL;
+        goto fail;
+    }
+    if (!memcmp(old->map, "!<thin>\n", 8))
+        old->thin = 1;
+    else if (memcmp(old->map, "!<arch>\n", 8))
+        goto fail;
+
+    /* read the member headers */
+    for (pos = 8; pos + 60 <= old->sz;) {
+        const unsigned char *hdr = old->map + pos;
+        unsigned long long size = arField(hdr + 48, 10, 10);
+        const char *name;
+        int hasData = !old->thin || !memcmp(hdr, "/ ", 2) || !memcmp(hdr, "// ", 3);
+
+        if (hdr[58] != '`' || hdr[59] != '\n' ||
+            (hasData && size > old->sz - pos - 60))
+            goto fail;
+
+        if (!memcmp(hdr, "/ ", 2)) {
+            index = hdr + 60;
+            indexSz = size;
+
+        } else if (!memcmp(hdr, "// ", 3)) {
+            longNames = hdr + 60;
+            longSz = size;
 
-            f = fopen(outName, "w");
-            if (!f) {
-                perror(outName);
-                execLibtool(opt);
+        } else {
+            if (hdr[0] == '/') {
+                /* a long name, or something we don't understand (/SYM64/) */
+                unsigned long long off;
+                const unsigned char *end;
+                if (hdr[1] < '0' || hdr[1] > '9' || !longNames)
+                    goto fail;
+                off = arField(hdr + 1, 15, 10);
+                if (off >= longSz ||
+                    !(end = memchr(longNames + off, '\n', longSz - off)) ||
+                    end == longNames + off || end[-1] != '/')
+                    goto fail;
+                end--;
+                name = arenaPrintf(opt, "%.*s", (int) (end - longNames - off),
+                                   (const char *) longNames + off);
+            } else {
+                const unsigned char *end = memchr(hdr, '/', 16);
+                if (!end) goto fail;
+                name = arenaPrintf(opt, "%.*s", (int) (end - hdr), (const char *) hdr);
             }
 
-            fputs(BIN_SCRIPT_1, f);
+            GROW_ARRAY(opt, old->members, old->membersUsed, old->membersSz);
+            om = &old->members[old->membersUsed++];
+            memset(om, 0, sizeof(struct ArOldMember));
+            om->name = name;
+            om->hdr = pos;
+            om->size = size;
+            om->mtime = arField(hdr + 16, 12, 10);
+            om->uid = arField(hdr + 28, 6, 10);
+            om->gid = arField(hdr + 34, 6, 10);
+            om->mode = arField(hdr + 40, 8, 8);
 
-            /* write all the library paths */
-            for (i = 0; i < libDirs.bufused; i++) {
-                if (i != 0) fputs(":", f);
-                fputs(libDirs.buf[i], f);
-            }
+        }
 
-            fputs(BIN_SCRIPT_2, f);
+        pos += 60;
+        if (hasData) pos += size + (size & 1);
+    }
 
-            /* then the program name */
-            if ((absName = realpath(realName, NULL))) {
-                fputs(absName, f);
-                free(absName);
-            } else {
-                fputs(realName, f);
+    /* without an index, we don't know the members' symbols */
+    if (!index && old->membersUsed)
+        goto fail;
+    if (!index)
+        return 0;
+
+    /* read the index, assigning each symbol to its member */
+    if (indexSz < 4) goto fail;
+    count = elfInt(index, 4, 1);
+    if (count > (indexSz - 4) / 4) goto fail;
+    ORL(old->syms, malloc, NULL, ((count + 1) * sizeof(const char *)));
+    ORL(syms, malloc, NULL, ((count + 1) * sizeof(const char *)));
+    {
+        const char *name = (const char *) index + 4 + 4 * count;
+        const char *end = (const char *) index + indexSz;
+        for (i = 0; i < count; i++) {
+            unsigned long long off = elfInt(index + 4 + 4 * i, 4, 1);
+            size_t lo = 0, hi = old->membersUsed;
+            const char *nul = name < end ? memchr(name, '\0', end - name) : NULL;
+
+            /* find the member with this header */
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (old->members[mid].hdr < off) lo = mid + 1;
+                else hi = mid;
             }
-
-            if (fputs(BIN_SCRIPT_3, f) == EOF) {
-                perror(outName);
-                execLibtool(opt);
+            if (!nul || lo >= old->membersUsed || old->members[lo].hdr != off) {
+                free(syms);
+                goto fail;
             }
-
-            fclose(f);
-
-            /* now try to make it executable */
-            chmod(outName, 0755);
+            syms[i] = name;
+            old->members[lo].symCount++;
+            name = nul + 1;
         }
 
-        free(realName);
+        /* then group them by member */
+        pos = 0;
+        for (i = 0; i < old->membersUsed; i++) {
+            old->members[i].firstSym = pos;
+            pos += old->members[i].symCount;
+            old->members[i].symCount = 0;
+        }
+        for (i = 0; i < count; i++) {
+            unsigned long long off = elfInt(index + 4 + 4 * i, 4, 1);
+            size_t lo = 0, hi = old->membersUsed;
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (old->members[mid].hdr < off) lo = mid + 1;
+                else hi = mid;
+            }
+            om = &old->members[lo];
+            old->syms[om->firstSym + om->symCount++] = syms[i];
+        }
     }
+    free(syms);
+    old->symsUsed = count;
+    return 0;
 
-    /* the rest all require a shortname */
-    ext = strrchr(outBase, '.');
-    if (ext) *ext = '\0';
+fail:
+    arFreeOld(old);
+    return -1;
+}
 
-    /* building a .a library is mostly simple */
-    if (buildA) {
-        char *apath;
+/* The path to a file from a directory, for thin archives' member names */
+static char *arThinName(struct Options *opt, const char *dir, const char *path)
+{
+    char *real = arenaRealpath(opt, path), *ret, *rp;
+    size_t i, common = 0, ups = 0;
+
+    if (!real || !dir || !strcmp(dir, "/"))
+        return real;
+
+    /* find the directory they have in common */
+    for (i = 0; dir[i] && dir[i] == real[i]; i++)
+        if (dir[i] == '/') common = i;
+    if (!dir[i] && real[i] == '/') common = i;
+
+    /* then go up to it and back down */
+    for (i = common; dir[i]; i++)
+        if (dir[i] == '/') ups++;
+    ret = rp = arenaAlloc(opt, ups * 3 + strlen(real + common));
+    for (i = 0; i < ups; i++) {
+        memcpy(rp, "../", 3);
+        rp += 3;
+    }
+    strcpy(rp, real + common + 1);
+    return ret;
+}
 
-        ORL(afile, malloc, NULL, (strlen(outBase) + 3));
-        sprintf(afile, "%s.a", outBase);
+/* Add a member to an archive being written, reusing it from the old archive
+ * if it hasn't changed, or reading its symbols otherwise. A member of a normal
+ * archive is unchanged if its contents are, and a thin archive's if it's
+ * older than the archive. Returns -1 if it can't be added. */
+static int arAddMember(struct Options *opt, struct ArWriter *ar,
+                       struct ArOld *old, const char *path,
+                       int thin, const char *thinDir)
+{
+    struct ArMember *member;
+    struct ArOldMember *om = NULL;
+    size_t i, j;
+    void *obj;
+    int fd, ret;
+
+    GROW_ARRAY(opt, ar->members, ar->membersUsed, ar->membersSz);
+    member = &ar->members[ar->membersUsed];
+    member->path = path;
+    member->name = thin ? arThinName(opt, thinDir, path) : arenaBasename(opt, path, 0);
+    member->longName = -1;
+    member->old = NULL;
+
+    if (!member->name || stat(path, &member->sb) != 0 || member->sb.st_size <= 0)
+        return -1;
+
+    /* look for it in the old archive, usually right after the last one */
+    for (i = 0; i < old->membersUsed; i++) {
+        om = &old->members[(old->next + i) % old->membersUsed];
+        if (!om->used && om->size == (unsigned long long) member->sb.st_size &&
+            !strcmp(om->name, member->name))
+            break;
+    }
+    if (i == old->membersUsed)
+        om = NULL;
+
+    /* a thin archive doesn't have its contents, so go by the time */
+    if (om && thin &&
+        (member->sb.st_mtim.tv_sec > old->mtim.tv_sec ||
+         (member->sb.st_mtim.tv_sec == old->mtim.tv_sec &&
+          member->sb.st_mtim.tv_nsec >= old->mtim.tv_nsec)))
+        om = NULL;
+
+    obj = NULL;
+    if (!om || !thin) {
+        if ((fd = open(path, O_RDONLY)) < 0)
+            return -1;
+        obj = mmap(NULL, member->sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (obj == MAP_FAILED)
+            return -1;
+        if (om && memcmp(obj, old->map + om->hdr + 60, member->sb.st_size))
+            om = NULL;
+    }
 
-        ORL(apath, malloc, NULL, (strlen(outDir) + strlen(afile) + 8));
-        sprintf(apath, "%s/.libs/%s", outDir, afile);
-        outAr.buf[2] = apath;
+    if (om) {
+        om->used = 1;
+        old->next = (om - old->members) + 1;
+        member->old = om;
+        for (j = 0; j < om->symCount; j++) {
+            GROW_ARRAY(opt, ar->symbols, ar->symbolsUsed, ar->symbolsSz);
+            ar->symbols[ar->symbolsUsed].name = old->syms[om->firstSym + j];
+            ar->symbols[ar->symbolsUsed].member = ar->membersUsed;
+            ar->symbolsUsed++;
+        }
+        if (obj) munmap(obj, member->sb.st_size);
+        ar->membersUsed++;
+        return 0;
+    }
 
-        /* run ar */
-        WRITE_BUFFER(outAr, NULL);
-        spawn(opt, outAr.buf);
-        outAr.bufused--;
+    /* it's new, so read it */
+    ret = arReadSymbols(opt, ar, ar->membersUsed, obj, member->sb.st_size);
+    munmap(obj, member->sb.st_size);
+    if (ret == 0)
+        ar->membersUsed++;
+    return ret;
+}
 
-        /* and make sure to ranlib too! */
-        outAr.buf[1] = "ranlib";
-        outAr.buf[3] = NULL;
-        spawn(opt, outAr.buf + 1);
+/* Format an archive member header (60 characters, plus a NUL, but out should
+ * have room for AR_HEADER_ROOM) */
+#define AR_HEADER_ROOM 128
+static void arFormatHeader(char *out, const char *name, long long mtime,
+                           long uid, long gid, unsigned long mode,
+                           unsigned long long size)
+{
+    /* fields that don't fit are zeroed, as ar does */
+    if (mtime < 0 || mtime > 999999999999LL) mtime = 0;
+    if (uid < 0 || uid > 999999) uid = 0;
+    if (gid < 0 || gid > 999999) gid = 0;
+    sprintf(out, "%-16s%-12lld%-6ld%-6ld%-8lo%-10llu`\n",
+            name, mtime, uid, gid, mode & 07777777, size);
+}
 
-        free(apath);
-    }
+/* Members are written deterministically, as ar's D modifier (the default in
+ * most builds of GNU ar) does: no time, owner or group, and mode 644 */
+#define AR_MEMBER_MODE 0644
 
-    /* and building a .so file is the most complicated */
-    if (buildSo) {
-        char *sopath = NULL,
-             *longpath = NULL,
-             *linkpath = NULL,
-             *sonameFlag = NULL;
+/* Is this archive exactly what's already there? */
+static int arUnchanged(struct ArWriter *ar, struct ArOld *old)
+{
+    size_t i;
 
-        if (!avoidVersion) {
-            /* we have three filenames:
-             * (1) the soname, .so.major
-             * (2) the long name, .so.major.minor.revision
-             * (3) the linker name, .software
-             */
-            ORL(soname, malloc, NULL, (strlen(outBase) + 4*sizeof(int) + 5));
-            sprintf(soname, "%s.so.%d", outBase, major);
-            ORL(longname, malloc, NULL, (strlen(outBase) + 3*4*sizeof(int) + 7));
-            sprintf(longname, "%s.so.%d.%d.%d", outBase, major, minor, revision);
-            ORL(linkname, malloc, NULL, (strlen(outBase) + 4));
-            sprintf(linkname, "%s.so", outBase);
+    if (!old->map || ar->membersUsed != old->membersUsed ||
+        ar->symbolsUsed != old->symsUsed)
+        return 0;
+    for (i = 0; i < ar->membersUsed; i++) {
+        struct ArMember *member = &ar->members[i];
+        if (member->old != &old->members[i] ||
+            member->old->mtime != 0 || member->old->uid != 0 ||
+            member->old->gid != 0 || member->old->mode != AR_MEMBER_MODE)
+            return 0;
+    }
+    return 1;
+}
 
-        } else {
-            /* just one soname: .so */
-            ORL(soname, malloc, NULL, (strlen(outBase) + 4));
-            sprintf(soname, "%s.so", outBase);
+/* Do what `ar rcsD <archive> <objects>...` would (or `ar rcsDT` if thin is
+ * set), given that command. Members that haven't changed since the archive was
+ * last written are copied from it, along with their symbols, and if nothing
+ * changed, the archive is left alone. Returns -1 (having written nothing) if
+ * we can't write the archive, so the caller should use the real ar. */
+static int arWrite(struct Options *opt, char *const *cmd, int thin)
+{
+    const char *path = cmd[2];
+    char *const *objs = cmd + 3;
+    char *thinDir = NULL;
+    struct ArWriter ar;
+    struct ArOld old;
+    struct Buffer longNames;
+    unsigned long long symSz = 0, longSz = 0, offset;
+    unsigned char *head = NULL, *hp;
+    char hdr[AR_HEADER_ROOM], *tmpName;
+    size_t i;
+    int ret = -1, fd = -1;
+
+    memset(&ar, 0, sizeof(ar));
+    INIT_BUFFER(longNames);
+    arReadOld(opt, &old, path);
+    if (old.thin != thin)
+        arFreeOld(&old); /* its members are no use */
+
+    /* thin archives name their members relative to themselves */
+    if (thin)
+        thinDir = arenaRealpath(opt, arenaDirname(opt, path));
+
+    /* read in all the members */
+    for (i = 0; objs[i]; i++)
+        if (arAddMember(opt, &ar, &old, objs[i], thin, thinDir) != 0)
+            goto out;
+
+    printCmd(opt, cmd);
+    if (opt->dryRun || arUnchanged(&ar, &old)) {
+        ret = 0;
+        goto out;
+    }
+
+    /* lay out the archive */
+    if (ar.symbolsUsed) {
+        symSz = 4 + 4 * (unsigned long long) ar.symbolsUsed;
+        for (i = 0; i < ar.symbolsUsed; i++)
+            symSz += strlen(ar.symbols[i].name) + 1;
+    }
+    for (i = 0; i < ar.membersUsed; i++) {
+        struct ArMember *member = &ar.members[i];
+        if (thin || strlen(member->name) > 15) {
+            member->longName = (long) longSz;
+            longSz += strlen(member->name) + 2;
+            WRITE_BUFFER(longNames, (char *) member->name);
+        }
+    }
+    longSz += longSz & 1; /* ar counts the padding in this one */
+    offset = 8;
+    if (symSz) offset += 60 + symSz + (symSz & 1);
+    if (longSz) offset += 60 + longSz;
+    ORL(head, malloc, NULL, (offset + AR_HEADER_ROOM));
+    for (i = 0; i < ar.membersUsed; i++) {
+        ar.members[i].offset = offset;
+        offset += 60;
+        if (!thin)
+            offset += ar.members[i].sb.st_size + (ar.members[i].sb.st_size & 1);
+    }
+    if (offset > 0xffffffffULL)
+        goto out; /* too big for a 32-bit index */
+
+    /* make everything before the members */
+    hp = head;
+    memcpy(hp, thin ? "!<thin>\n" : "!<arch>\n", 8);
+    hp += 8;
+    if (symSz) {
+        arFormatHeader((char *) hp, "/", 0, 0, 0, 0, symSz);
+        hp += 60;
+#define WRITE_BE32(x) do { \
+    unsigned long x_ = (x); \
+    hp[0] = x_ >> 24; hp[1] = x_ >> 16; hp[2] = x_ >> 8; hp[3] = x_; \
+    hp += 4; \
+} while (0)
+        WRITE_BE32(ar.symbolsUsed);
+        for (i = 0; i < ar.symbolsUsed; i++)
+            WRITE_BE32(ar.members[ar.symbols[i].member].offset);
+#undef WRITE_BE32
+        for (i = 0; i < ar.symbolsUsed; i++)
+            hp += sprintf((char *) hp, "%s", ar.symbols[i].name) + 1;
+        if (symSz & 1) *hp++ = '\n';
+    }
+    if (longSz) {
+        /* this header has only a size */
+        hp += sprintf((char *) hp, "%-48s%-10llu`\n", "//", longSz);
+        for (i = 0; i < longNames.bufused; i++)
+            hp += sprintf((char *) hp, "%s/\n", longNames.buf[i]);
+        if ((hp - head) & 1) *hp++ = '\n';
+    }
+
+    /* write it to a temporary file, then move it into place */
+    tmpName = arenaPrintf(opt, "%s.%d", path, (int) getpid());
+    if ((fd = open(tmpName, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0)
+        goto out;
+    if (writeAll(fd, head, hp - head) != 0)
+        goto fail;
+
+    for (i = 0; i < ar.membersUsed; i++) {
+        struct ArMember *member = &ar.members[i];
+        char name[32];
+        int in;
+
+        if (member->longName >= 0)
+            sprintf(name, "/%ld", member->longName);
+        else
+            sprintf(name, "%s/", member->name);
+        arFormatHeader(hdr, name, 0, 0, 0, AR_MEMBER_MODE, member->sb.st_size);
+        if (writeAll(fd, hdr, 60) != 0)
+            goto fail;
+
+        /* copy it in, from the old archive if it's there */
+        if (thin) {
+            /* (or not at all) */
+        } else if (member->old) {
+            if (copyRange(old.fd, member->old->hdr + 60, fd, member->sb.st_size) != 0)
+                goto fail;
+        } else {
+            struct stat sb;
+            if ((in = open(member->path, O_RDONLY)) < 0)
+                goto fail;
+            if (fstat(in, &sb) != 0 || sb.st_size != member->sb.st_size ||
+                copyRange(in, 0, fd, member->sb.st_size) != 0) {
+                close(in);
+                goto fail; /* it changed under us */
+            }
+            close(in);
+        }
+        if ((member->sb.st_size & 1) && writeAll(fd, "\n", 1) != 0)
+            goto fail;
+    }
+
+    if (close(fd) == 0 && rename(tmpName, path) == 0) {
+        fd = -1;
+        ret = 0;
+        goto out;
+    }
+    fd = -1;
+
+fail:
+    if (fd >= 0) close(fd);
+    unlink(tmpName);
+
+out:
+    arFreeOld(&old);
+    free(head);
+    free(ar.members);
+    free(ar.symbols);
+    FREE_BUFFER(longNames);
+    return ret;
+}
+
+/* With --link-cache, each link leaves a stamp in .libs with a digest of
+ * everything that went into it (the commands, the compiler, and the contents
+ * of the objects, archives and libraries they name), and the outputs it made.
+ * If the next link has the same digest and its outputs are still as the last
+ * one left them, the linker and ar aren't run again. */
+#define LINK_STAMP_HEADER "# mlibtool link stamp 1\n"
+
+/* Hash a file's name and contents. Returns 0 if it's a regular file. */
+static int sha256File(struct Sha256 *sha, const char *path)
+{
+    struct stat sb;
+    char size[32];
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) return -1;
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    sprintf(size, "%lld", (long long) sb.st_size);
+    sha256Update(sha, path, strlen(path) + 1);
+    sha256Update(sha, size, strlen(size) + 1);
+    if (sb.st_size) {
+        map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        sha256Update(sha, map, sb.st_size);
+        munmap(map, sb.st_size);
+    }
+    close(fd);
+    return 0;
+}
+
+/* Hash the library a -l flag finds in the -L directories of cmd. Libraries
+ * found elsewhere are only hashed by name. */
+static void linkCacheLib(struct Options *opt, struct Sha256 *sha,
+                         struct Buffer *cmd, const char *lib)
+{
+    size_t i;
+    int found;
+
+    for (i = 0; i < cmd->bufused; i++) {
+        char *dir = cmd->buf[i];
+        if (strncmp(dir, "-L", 2) || !dir[2]) continue;
+        found = !sha256File(sha, arenaPrintf(opt, "%s/lib%s.so", dir + 2, lib));
+        found |= !sha256File(sha, arenaPrintf(opt, "%s/lib%s.a", dir + 2, lib));
+        if (found) return;
+    }
+    sha256Update(sha, lib, strlen(lib) + 1);
+}
+
+/* Digest a link: the link command cmd (writing to cmd[outPos]), the ar
+ * command ar, and params, a summary of the options which decide how they're
+ * finished. Returns NULL if the compiler can't be identified. */
+static char *linkCacheDigest(struct Options *opt, struct Buffer *cmd,
+                             size_t outPos, struct Buffer *ar,
+                             const char *params)
+{
+    struct Sha256 sha;
+    struct Buffer *cmds[2];
+    struct stat sb;
+    char hash[65], cwd[4096];
+    char *ident, *ccPath, *env;
+    size_t i, j;
+
+    WRITE_BUFFER(*cmd, NULL);
+    ident = compilerIdentity(cmd->buf[0], cmd->buf, &ccPath, &sb);
+    cmd->bufused--;
+    if (!ident) return NULL;
+    free(ccPath);
+    if (!getcwd(cwd, sizeof(cwd))) {
+        free(ident);
+        return NULL;
+    }
+
+    sha256Init(&sha);
+    sha256Update(&sha, LINK_STAMP_HEADER, strlen(LINK_STAMP_HEADER));
+    sha256Update(&sha, ident, strlen(ident) + 1);
+    sha256Update(&sha, cwd, strlen(cwd) + 1);
+    sha256Update(&sha, params, strlen(params) + 1);
+    env = arenaPrintf(opt, "%s %s", getenv("AR") ? getenv("AR") : "",
+                      getenv("RANLIB") ? getenv("RANLIB") : "");
+    sha256Update(&sha, env, strlen(env) + 1);
+    free(ident);
+
+    cmds[0] = cmd;
+    cmds[1] = ar;
+    for (i = 0; i < 2; i++) {
+        sha256Update(&sha, "", 1);
+        for (j = 0; j < cmds[i]->bufused; j++) {
+            char *arg = cmds[i]->buf[j], *part, *end;
+            sha256Update(&sha, arg, strlen(arg) + 1);
+
+            if (arg[0] != '-') {
+                if (i || j != outPos)
+                    sha256File(&sha, arg);
+
+            } else if (!strncmp(arg, "-l", 2)) {
+                linkCacheLib(opt, &sha, cmd, arg + 2);
+
+            } else if (!strncmp(arg, "-Wl,", 4)) {
+                /* any files the linker is told to read */
+                part = arenaStrdup(opt, arg + 4);
+                for (; part; part = end) {
+                    if ((end = strchr(part, ','))) *end++ = '\0';
+                    if (strchr(part, '=')) part = strchr(part, '=') + 1;
+                    sha256File(&sha, part);
+                }
+
+            }
+        }
+    }
+
+    sha256Final(&sha, hash);
+    return arenaStrdup(opt, hash);
+}
+
+/* Was the last link with this stamp the same as this one, and are its
+ * outputs untouched? */
+static int linkCacheFresh(const char *stamp, const char *digest)
+{
+    char line[4200];
+    long long mtime, size, ino;
+    struct stat sb;
+    int pos, outputs = 0;
+    FILE *f;
+
+    if (!(f = fopen(stamp, "r"))) return 0;
+    if (!fgets(line, sizeof(line), f) || strcmp(line, LINK_STAMP_HEADER) ||
+        !fgets(line, sizeof(line), f) || strncmp(line, digest, 64) ||
+        line[64] != '\n')
+        goto stale;
+
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%lld %lld %lld %n", &mtime, &size, &ino, &pos) < 3 ||
+            stat(line + pos, &sb) != 0 ||
+            (long long) sb.st_mtime != mtime || (long long) sb.st_size != size ||
+            (long long) sb.st_ino != ino)
+            goto stale;
+        outputs++;
+    }
+
+    fclose(f);
+    return outputs > 0;
+
+stale:
+    fclose(f);
+    return 0;
+}
+
+/* Record a link in its stamp */
+static void linkCacheWrite(struct Options *opt, const char *stamp,
+                           const char *digest, struct Buffer *outputs)
+{
+    char *tmpName = arenaPrintf(opt, "%s.%d", stamp, (int) getpid());
+    struct stat sb;
+    size_t i;
+    FILE *f;
+
+    if (!(f = fopen(tmpName, "w"))) return;
+    fprintf(f, LINK_STAMP_HEADER "%s\n", digest);
+    for (i = 0; i < outputs->bufused; i++) {
+        if (stat(outputs->buf[i], &sb) != 0) {
+            fclose(f);
+            unlink(tmpName);
+            return;
+        }
+        fprintf(f, "%lld %lld %lld %s\n", (long long) sb.st_mtime,
+                (long long) sb.st_size, (long long) sb.st_ino, outputs->buf[i]);
+    }
+    if (fclose(f) != 0 || rename(tmpName, stamp) != 0)
+        unlink(tmpName);
+}
+
+static void ltlink(struct Options *opt)
+{
+    struct Buffer outCmd, outAr, libDirs, dependencyLibs, outputs;
+    struct LaGraph laGraph;
+    size_t i;
+    char *ext;
+    int tmpi;
+
+    /* options */
+    int major = 0,
+        minor = 0,
+        revision = 0,
+        module = 0,
+        avoidVersion = 0,
+        rpathSpecified = 0,
+        inPlace = opt->runpath; /* a program to run without a wrapper */
+    char *outName = NULL,
+         *rpath = NULL,
+         *insane = NULL; /* the first option we don't support */
+    size_t outNamePos = 0;
+
+    /* option derivatives */
+    int buildBinary = 0,
+        buildLib = 0,
+        buildSo = 0,
+        buildA = 0,
+        buildPicA = 0,
+        thinA = 0;
+    char *outDir = NULL,
+         *libsDir = NULL,
+         *outBase = NULL,
+         *afile = NULL,
+         *soname = NULL,
+         *longname = NULL,
+         *linkname = NULL,
+         *stamp = NULL,
+         *digest = NULL,
+         *runpath = NULL, /* the rpath we add to run a program in place */
+         *sopath = NULL,
+         *longpath = NULL,
+         *linkpath = NULL;
+    int unchanged = 0;
+    pid_t soPid = 0;
+    int soToken = -1;
+    long long arStart = 0;
+
+
+    /* before we can even start, we have to figure out what we're building to
+     * know whether to build the command out of static .o or pic .o files */
+    for (i = 1; opt->cmd[i]; i++) {
+        if (opt->cmd[i+1]) {
+            if (!strcmp(opt->cmd[i], "-o"))
+                outName = opt->cmd[i+1];
+            else if (!strcmp(opt->cmd[i], "-rpath"))
+                rpathSpecified = 1;
+        }
+    }
+
+    if (outName) {
+        statsOutput = outName;
+        ext = strrchr(outName, '.');
+        if (ext && !strcmp(ext, ".la")) {
+            /* it's a libtool library */
+            buildLib = 1;
+            buildA = opt->buildStatic;
+
+        } else {
+            /* it's a binary */
+            buildBinary = 1;
+
+        }
+    }
+
+    /* should we build a .so? */
+    if (buildLib) {
+        if (rpathSpecified) {
+            buildSo = opt->buildShared;
+        } else {
+            buildA = 1;
+            buildPicA = 1;
+
+            /* a convenience library, only used in this build tree */
+            thinA = opt->thinConvenience;
+        }
+    }
+
+    /* allocate our buffers */
+    INIT_BUFFER(outCmd);
+    INIT_BUFFER(outAr);
+    INIT_BUFFER(libDirs);
+    INIT_BUFFER(dependencyLibs);
+    INIT_BUFFER(outputs);
+    memset(&laGraph, 0, sizeof(laGraph));
+
+    WRITE_BUFFER(outCmd, opt->cmd[0]);
+    WRITE_BUFFER(outAr, "ar");
+    WRITE_BUFFER(outAr, "rc");
+    WRITE_BUFFER(outAr, "a.a"); /* to be replaced */
+
+    /* `pwd`/.libs is always in -L */
+    WRITE_BUFFER(outCmd, "-L.libs");
+    addLibDir(opt, &libDirs, ".libs");
+
+    /* read in the command */
+    for (i = 1; opt->cmd[i]; i++) {
+        char *arg = opt->cmd[i];
+        char *narg = opt->cmd[i+1];
+
+        if (arg[0] == '-') {
+            if (!strcmp(arg, "-all-static")) {
+                WRITE_BUFFER(outCmd, "-static");
+
+            } else if (!strcmp(arg, "-avoid-version")) {
+                avoidVersion = 1;
+
+            } else if (!strcmp(arg, "-export-dynamic")) {
+                WRITE_BUFFER(outCmd, "-rdynamic");
+
+            } else if (!strncmp(arg, "-L", 2)) {
+                char *llibs;
+
+                /* need both the -L path specified and .../.libs */
+                WRITE_BUFFER(outCmd, arg);
+                WRITE_BUFFER(dependencyLibs, arg);
+                addLibDir(opt, &libDirs, arg + 2);
+
+                llibs = arenaPrintf(opt, "%s/.libs", arg);
+
+                WRITE_BUFFER(outCmd, llibs);
+                WRITE_BUFFER(dependencyLibs, llibs);
+                addLibDir(opt, &libDirs, llibs + 2);
+
+            } else if (!strncmp(arg, "-l", 2)) {
+                WRITE_BUFFER(outCmd, arg);
+                WRITE_BUFFER(dependencyLibs, arg);
+
+            } else if (!strcmp(arg, "-module")) {
+                module = 1;
+
+            } else if (!strcmp(arg, "-o") && narg) {
+                WRITE_BUFFER(outCmd, arg);
+                outNamePos = outCmd.bufused;
+                WRITE_BUFFER(outCmd, narg);
+                i++;
+
+            } else if (!strcmp(arg, "-rpath") && narg) {
+                rpath = narg;
+                i++;
+
+            } else if (!strcmp(arg, "-version-info") && narg) {
+                /* current:revision:age instead of major.minor.revision */
+                int current = 0;
+                revision = 0;
+
+                /* if the format fails in any way, just use 0 */
+                sscanf(narg, "%d:%d:%d", &current, &revision, &minor);
+                if (minor > current) minor = current;
+                major = current - minor;
+
+                i++;
+
+            } else if (!strncmp(arg, "-Wc,", 4)) {
+                WRITE_BUFFER(outCmd, arg + 4);
+
+            } else if (narg &&
+                       (!strcmp(arg, "-Xcompiler") ||
+                        !strcmp(arg, "-XCClinker"))) {
+                WRITE_BUFFER(outCmd, narg);
+                i++;
+
+            } else if (!strcmp(arg, "-dlopen") ||
+                       !strcmp(arg, "-dlpreopen") ||
+                       !strcmp(arg, "-export-symbols") ||
+                       !strcmp(arg, "-export-symbols-regex") ||
+                       !strcmp(arg, "-objectlist") ||
+                       !strcmp(arg, "-precious-files-regex") ||
+                       !strcmp(arg, "-release") ||
+                       !strcmp(arg, "-shared") ||
+                       !strcmp(arg, "-shrext") ||
+                       !strcmp(arg, "-static") ||
+                       !strcmp(arg, "-static-libtool-libs") ||
+                       !strcmp(arg, "-weak")) {
+                /* unsupported */
+                if (!insane) insane = arg;
+
+            } else if (!strcmp(arg, "-bindir") && narg) {
+                /* ignored for compatibility */
+                i++;
+
+            } else if (!strcmp(arg, "-no-install")) {
+                inPlace = 1;
+
+            } else if (!strcmp(arg, "-no-fast-install") ||
+                       !strcmp(arg, "-no-undefined")) {
+                /* ignored for compatibility */
+
+            } else {
+                WRITE_BUFFER(outCmd, arg);
+
+            }
+
+        } else {
+            ext = strrchr(arg, '.');
+            if (ext && !strcmp(ext, ".lo")) {
+                /* make separate versions for the .a and the .so */
+                char *loDir, *loBase, *loPic, *loNonPic;
+
+                /* OK, it's a .lo file, figure out the .libs name */
+                loDir = arenaDirname(opt, arg);
+                loBase = arenaBasename(opt, arg, 1);
+
+                /* make the .libs/.o version */
+                loPic = arenaLibsPath(opt, loDir, loBase, ".o");
+                loNonPic = arenaPrintf(opt, "%s/%s.o", loDir, loBase);
+
+                /* which .o we choose depends on a complexicon of situations */
+                if (buildPicA)
+                    WRITE_BUFFER(outAr, loPic);
+                else
+                    WRITE_BUFFER(outAr, loNonPic);
+                if (buildBinary)
+                    WRITE_BUFFER(outCmd, loNonPic);
+                else
+                    WRITE_BUFFER(outCmd, loPic);
+
+            } else if (ext && !strcmp(ext, ".la")) {
+                laGraphAddRoot(opt, buildLib, &laGraph, &outCmd, &dependencyLibs, arg);
+
+            } else {
+                WRITE_BUFFER(outAr, arg);
+                WRITE_BUFFER(outCmd, arg);
+
+            }
+
+        }
+    }
+
+    if (insane) {
+        /* just go to libtool */
+        execLibtool(opt, "unsupported option %s", insane);
+    }
+
+    /* make sure an output name was specified */
+    if (!outName) {
+        outName = "a.out";
+        buildBinary = 1;
+        WRITE_BUFFER(outCmd, "-o");
+        outNamePos = outCmd.bufused;
+        WRITE_BUFFER(outCmd, outName);
+    }
+    statsOutput = outName;
+
+    /* put the .la files in the command */
+    laGraphExpand(opt, &laGraph, &outCmd, &outNamePos, &libDirs);
+
+    /* get the directory names */
+    outDir = arenaDirname(opt, outName);
+    outBase = arenaBasename(opt, outName, 0);
+
+    /* make the .libs dir */
+    libsDir = arenaPrintf(opt, "%s/.libs", outDir);
+    if (!opt->dryRun) mkdir(libsDir, 0777); /* ignore errors */
+
+    /* a program to run in place finds its uninstalled libraries by an rpath
+     * relative to itself, and any others by the same directories a wrapper
+     * would use. This is DT_RPATH, not DT_RUNPATH, so that it's also used to
+     * find the libraries' own dependencies. Install removes all of it. */
+    if (buildBinary && inPlace) {
+        char *origin = arenaRealpath(opt, outDir);
+
+        for (i = 0; origin && i < libDirs.bufused; i++) {
+            char *dir = libDirs.buf[i];
+            size_t len = strlen(dir), j;
+            struct stat sb;
+
+            if (dir[0] != '/' || stat(dir, &sb) != 0 || !S_ISDIR(sb.st_mode))
+                continue;
+            for (j = 0; j < i && strcmp(libDirs.buf[j], dir); j++);
+            if (j < i) continue;
+
+            if (len >= 6 && !strcmp(dir + len - 6, "/.libs"))
+                dir = arenaOriginPath(opt, origin, dir);
+            runpath = runpath ? arenaPrintf(opt, "%s:%s", runpath, dir) : dir;
+        }
+
+        if (runpath) {
+            WRITE_BUFFER(outCmd, "-Wl,--disable-new-dtags");
+            WRITE_BUFFER(outCmd, arenaPrintf(opt, "-Wl,-rpath,%s", runpath));
+        }
+    }
+
+    /* maybe nothing has changed since the last link */
+    if (opt->linkCache && !opt->dryRun) {
+        stamp = arenaPrintf(opt, "%s/%s.link", libsDir, outBase);
+        digest = linkCacheDigest(opt, &outCmd, outNamePos, &outAr,
+                                 arenaPrintf(opt, "%d %d %d %d %d %d %d %d %d %d %d",
+                                             buildBinary, buildA, buildPicA, thinA,
+                                             buildSo, major, minor, revision,
+                                             avoidVersion, opt->externalAr,
+                                             inPlace));
+        unchanged = digest && linkCacheFresh(stamp, digest);
+        if (unchanged && !opt->quiet)
+            fprintf(stderr, "mlibtool: %s is unchanged\n", outName);
+        if (!unchanged)
+            unlink(stamp);
+    }
+
+    if (buildBinary && inPlace) {
+        /* the program goes right at the output name */
+        WRITE_BUFFER(outCmd, NULL);
+        if (!unchanged)
+            spawn(opt, outCmd.buf);
+        outCmd.bufused--;
+        WRITE_BUFFER(outputs, outName);
+
+        /* and install mustn't find one from an earlier link, but must know
+         * what rpath to take out */
+        if (!opt->dryRun) {
+            char *record = arenaLibsPath(opt, outDir, outBase, ".rpath");
+            unlink(arenaLibsPath(opt, outDir, outBase, ""));
+            if (runpath) {
+                FILE *f = fopen(record, "w");
+                if (!f || fprintf(f, "%s\n", runpath) < 0 || fclose(f) != 0) {
+                    perror(record);
+                    exit(1);
+                }
+            } else {
+                unlink(record);
+            }
+        }
+
+    } else if (buildBinary) {
+        /* building a binary involves making a wrapper */
+        char *realName = arenaLibsPath(opt, outDir, outBase, "");
+
+        if (!opt->dryRun)
+            unlink(arenaLibsPath(opt, outDir, outBase, ".rpath"));
+
+        /* do the actual build */
+        outCmd.buf[outNamePos] = realName;
+        WRITE_BUFFER(outCmd, NULL);
+        if (!unchanged)
+            spawn(opt, outCmd.buf);
+        outCmd.bufused--;
+        WRITE_BUFFER(outputs, realName);
+
+        /* then make the wrapper */
+        if (!opt->dryRun) {
+            long long start = traceNow();
+            char *absName;
+            FILE *f;
+
+            f = fopen(outName, "w");
+            if (!f) {
+                perror(outName);
+                execLibtool(opt, "cannot write %s", outName);
+            }
+
+            fputs(BIN_SCRIPT_1, f);
+
+            /* write all the library paths */
+            for (i = 0; i < libDirs.bufused; i++) {
+                if (i != 0) fputs(":", f);
+                fputs(libDirs.buf[i], f);
+            }
+
+            fputs(BIN_SCRIPT_2, f);
+
+            /* then the program name */
+            if ((absName = realpath(realName, NULL))) {
+                fputs(absName, f);
+                free(absName);
+            } else {
+                fputs(realName, f);
+            }
+
+            if (fputs(BIN_SCRIPT_3, f) == EOF) {
+                perror(outName);
+                execLibtool(opt, "cannot write %s", outName);
+            }
+
+            fclose(f);
+
+            /* now try to make it executable */
+            chmod(outName, 0755);
+            traceFile("write", "write", start, outName);
+        }
+    }
+
+    /* the rest all require a shortname */
+    ext = strrchr(outBase, '.');
+    if (ext) *ext = '\0';
+
+    /* wait for a .so link left running */
+#define LTLINK_FINISH_SO() do { \
+    if (soPid) { \
+        tmpi = spawnWait(soPid, outCmd.buf); \
+        soPid = 0; \
+        jobTokenGive(soToken); \
+        if (tmpi) spawnFailed(opt); \
+    } \
+} while (0)
+
+    /* building a .so file is the most complicated */
+    if (buildSo) {
+        char *sonameFlag = NULL;
+
+        if (!avoidVersion) {
+            /* we have three filenames:
+             * (1) the soname, .so.major
+             * (2) the long name, .so.major.minor.revision
+             * (3) the linker name, .software
+             */
+            soname = arenaPrintf(opt, "%s.so.%d", outBase, major);
+            longname = arenaPrintf(opt, "%s.so.%d.%d.%d", outBase, major, minor, revision);
+            linkname = arenaPrintf(opt, "%s.so", outBase);
+
+        } else {
+            /* just one soname: .so */
+            soname = arenaPrintf(opt, "%s.so", outBase);
+
+        }
+
+        /* and get full paths for them all */
+        sopath = arenaLibsPath(opt, outDir, soname, "");
+        if (!avoidVersion) {
+            longpath = arenaLibsPath(opt, outDir, longname, "");
+            linkpath = arenaLibsPath(opt, outDir, linkname, "");
+        }
+
+        WRITE_BUFFER(outputs, sopath);
+        if (!avoidVersion) {
+            WRITE_BUFFER(outputs, longpath);
+            WRITE_BUFFER(outputs, linkpath);
+        }
+
+        /* unlink anything that already exists */
+        if (!unchanged) {
+            unlink(sopath);
+            if (longpath)
+                unlink(longpath);
+            if (linkpath)
+                unlink(linkpath);
+        }
+
+        /* set up the link command */
+        sonameFlag = arenaPrintf(opt, "-Wl,-h,%s", soname);
+        WRITE_BUFFER(outCmd, "-shared");
+        WRITE_BUFFER(outCmd, sonameFlag);
+        outCmd.buf[outNamePos] = longpath ? longpath : sopath;
+
+        /* link, leaving it running while we write the .a if there's room to
+         * do both at once */
+        WRITE_BUFFER(outCmd, NULL);
+        if (!unchanged) {
+            if (buildA && opt->maxJobs > 1 && (soToken = jobTokenTake()) >= 0) {
+                if (!(soPid = spawnStart(opt, outCmd.buf)))
+                    jobTokenGive(soToken); /* dry run */
+            } else
+                spawn(opt, outCmd.buf);
+        }
+    }
+
+    /* building a .a library is mostly simple */
+    if (buildA) {
+        afile = arenaPrintf(opt, "%s.a", outBase);
+        outAr.buf[2] = arenaLibsPath(opt, outDir, afile, "");
+        WRITE_BUFFER(outAr, NULL);
+        WRITE_BUFFER(outputs, outAr.buf[2]);
+
+        /* write it ourselves if we can */
+        outAr.buf[1] = thinA ? "rcsT" : "rcs";
+        if (unchanged) {
+            /* it's already right */
+
+        } else if (opt->externalAr ||
+                   (arStart = traceNow(), arWrite(opt, outAr.buf, thinA)) != 0) {
+            char *ranlib = getenv("RANLIB");
+
+            /* one child at a time from here */
+            LTLINK_FINISH_SO();
+
+            /* run ar */
+            if (getenv("AR") && getenv("AR")[0])
+                outAr.buf[0] = getenv("AR");
+            outAr.buf[1] = "rc";
+            if (thinA) {
+                /* ar won't turn an existing archive thin */
+                outAr.buf[1] = "rcT";
+                if (!opt->dryRun) unlink(outAr.buf[2]);
+            }
+            spawn(opt, outAr.buf);
+
+            /* and make sure to ranlib too! */
+            outAr.buf[1] = (ranlib && ranlib[0]) ? ranlib : "ranlib";
+            outAr.buf[3] = NULL;
+            spawn(opt, outAr.buf + 1);
+
+        } else {
+            traceFile("write", "ar", arStart, outAr.buf[2]);
+
+        }
+        outAr.bufused--;
+    }
+
+    /* the .so link is finished by now, so link in its shorter names */
+    if (buildSo) {
+        LTLINK_FINISH_SO();
+        outCmd.bufused--;
+
+        if (!opt->dryRun && !unchanged && !avoidVersion) {
+            if ((tmpi = symlink(longname, sopath)) < 0) {
+                perror(sopath);
+                exit(1);
+            }
+            if ((tmpi = symlink(longname, linkpath)) < 0) {
+                perror(linkpath);
+                exit(1);
+            }
+        }
+    }
+#undef LTLINK_FINISH_SO
+
+    /* finally, make the .la file */
+    if (buildLib) {
+        long long start = traceNow();
+        FILE *f = fopen(outName, "w");
+        if (!f) {
+            perror(outName);
+            execLibtool(opt, "cannot write %s", outName);
+        }
+
+        fprintf(f, SANE_HEADER
+                   PACKAGE_HEADER);
+
+        if (soname) {
+            /* we have a .so */
+            fprintf(f, "dlname='%s'\n", soname);
+
+            if (longname && linkname) {
+                /* and other names */
+                fprintf(f, "library_names='%s %s %s'\n",
+                        longname, soname, linkname);
+            } else {
+                fprintf(f, "library_names='%s'\n", soname);
+            }
+        } else {
+            fprintf(f, "dlname=''\nlibrary_names=''\n");
+        }
+
+        fprintf(f, "old_library='%s'\n"
+                   "inherited_linker_flags=''\n", afile ? afile : "");
+
+        fprintf(f, "dependency_libs='");
+        for (i = 0; i < dependencyLibs.bufused; i++)
+            fprintf(f, " %s", dependencyLibs.buf[i]);
+        fprintf(f, "'\n");
+
+        /* version info */
+        fprintf(f, "current=%d\n"
+                   "age=%d\n"
+                   "revision=%d\n",
+                   (major + minor) /* current is weird */,
+                   minor,
+                   revision);
+
+        fprintf(f, "installed=no\n"
+                   "shouldnotlink=%s\n"
+                   "dlopen=''\n"
+                   "dlpreopen=''\n"
+                   "libdir='%s'\n",
+                   (module ? "yes" : "no"),
+                   (rpath ? rpath : ""));
+
+        fclose(f);
+        traceFile("write", "write", start, outName);
+
+        /* and the index of everything it links in */
+        laGraphWriteIndex(opt, &laGraph, outName, &dependencyLibs, soname != NULL);
+    }
+
+    /* remember this link for next time */
+    if (digest && !unchanged)
+        linkCacheWrite(opt, stamp, digest, &outputs);
+
+    laGraphFree(&laGraph);
+    FREE_BUFFER(outputs);
+    FREE_BUFFER(dependencyLibs);
+    FREE_BUFFER(libDirs);
+    FREE_BUFFER(outAr);
+    FREE_BUFFER(outCmd);
+}
+
+/* a file for ltinstall to install */
+struct InstallJob {
+    char *src, *dest;
+    long mode; /* or -1 for the source's mode, less the umask */
+    int link; /* copy a symlink as a symlink */
+    char *stripRpath; /* the rpath ltlink added to run it in place, to
+                       * remove from the copy, or NULL */
+};
+
+/* Is this rpath entry in the colon-separated list? */
+static int rpathListed(const char *list, const char *entry, size_t len)
+{
+    const char *end;
+    for (; *list; list = *end ? end + 1 : end) {
+        end = strchr(list, ':');
+        if (!end) end = list + strlen(list);
+        if ((size_t) (end - list) == len && !strncmp(list, entry, len))
+            return 1;
+    }
+    return 0;
+}
+
+/* Remove the entries in strip (colon-separated, as ltlink recorded them) from
+ * the DT_RPATH (or DT_RUNPATH) of the ELF file open read-write on fd. The
+ * rpath is rewritten in place, or removed from the dynamic section if nothing
+ * else is left in it. Files that aren't ELF programs or libraries are left
+ * alone. Returns -1 on error. */
+static int elfStripRpath(int fd, const char *strip)
+{
+    struct stat sb;
+    unsigned char *obj;
+    size_t sz;
+    int is64, be;
+    unsigned long long shoff, shentsize, shnum, i, j, k;
+
+#define ELF_INT(p, n) elfInt((p), (n), be)
+#define SH(i) (obj + shoff + (i) * shentsize)
+#define SH_FIELD(sh, off32, off64, n32, n64) \
+    (is64 ? ELF_INT((sh) + (off64), (n64)) : ELF_INT((sh) + (off32), (n32)))
+#define SH_TYPE(sh) ELF_INT((sh) + 4, 4)
+#define SH_OFFSET(sh) SH_FIELD(sh, 16, 24, 4, 8)
+#define SH_SIZE(sh) SH_FIELD(sh, 20, 32, 4, 8)
+#define SH_LINK(sh) SH_FIELD(sh, 24, 40, 4, 4)
+#define IN_OBJ(off, len) ((off) <= sz && (len) <= sz - (off))
+#define D_TAG(d) (is64 ? ELF_INT((d), 8) : ELF_INT((d), 4))
+#define D_VAL(d) (is64 ? ELF_INT((d) + 8, 8) : ELF_INT((d) + 4, 4))
+
+    if (fstat(fd, &sb) != 0) return -1;
+    sz = sb.st_size;
+    if (!S_ISREG(sb.st_mode) || sz < 64) return 0;
+    obj = mmap(NULL, sz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (obj == MAP_FAILED) return -1;
+
+    if (memcmp(obj, "\177ELF", 4) ||
+        (obj[4] != 1 && obj[4] != 2) || (obj[5] != 1 && obj[5] != 2))
+        goto done;
+    is64 = (obj[4] == 2);
+    be = (obj[5] == 2);
+    if (ELF_INT(obj + 16, 2) != 2 /* ET_EXEC */ &&
+        ELF_INT(obj + 16, 2) != 3 /* ET_DYN */)
+        goto done;
+
+    if (is64) {
+        shoff = ELF_INT(obj + 40, 8);
+        shentsize = ELF_INT(obj + 58, 2);
+        shnum = ELF_INT(obj + 60, 2);
+    } else {
+        shoff = ELF_INT(obj + 32, 4);
+        shentsize = ELF_INT(obj + 46, 2);
+        shnum = ELF_INT(obj + 48, 2);
+    }
+    if (shentsize < (is64 ? 64 : 40) || !IN_OBJ(shoff, shentsize)) goto done;
+    if (shnum == 0) shnum = SH_SIZE(SH(0));
+    if (shnum > sz / shentsize || !IN_OBJ(shoff, shnum * shentsize)) goto done;
+
+    for (i = 0; i < shnum; i++) {
+        unsigned char *sh = SH(i), *dyn, *strtab;
+        unsigned long long dynSz, strSz, ent = is64 ? 16 : 8, n;
+
+        if (SH_TYPE(sh) != 6 /* SHT_DYNAMIC */ || SH_LINK(sh) >= shnum)
+            continue;
+        dyn = obj + SH_OFFSET(sh);
+        dynSz = SH_SIZE(sh);
+        strtab = obj + SH_OFFSET(SH(SH_LINK(sh)));
+        strSz = SH_SIZE(SH(SH_LINK(sh)));
+        if (!IN_OBJ(SH_OFFSET(sh), dynSz) ||
+            !IN_OBJ(SH_OFFSET(SH(SH_LINK(sh))), strSz))
+            continue;
+        n = dynSz / ent;
+
+        for (j = 0; j < n && D_TAG(dyn + j * ent) != 0 /* DT_NULL */; j++) {
+            unsigned long long tag = D_TAG(dyn + j * ent);
+            unsigned long long val = D_VAL(dyn + j * ent);
+            char *rpath, *entry, *end, *out;
+            size_t len;
+
+            if (tag != 15 /* DT_RPATH */ && tag != 29 /* DT_RUNPATH */)
+                continue;
+            if (val >= strSz || !memchr(strtab + val, '\0', strSz - val))
+                continue;
+            rpath = (char *) strtab + val;
+            len = strlen(rpath);
+
+            /* if anything else shares the string, leave it be */
+            for (k = 0; k < n && D_TAG(dyn + k * ent) != 0; k++) {
+                unsigned long long other = D_VAL(dyn + k * ent);
+                if (k != j && other >= val && other <= val + len &&
+                    (D_TAG(dyn + k * ent) == 1 /* DT_NEEDED */ ||
+                     D_TAG(dyn + k * ent) == 14 /* DT_SONAME */ ||
+                     D_TAG(dyn + k * ent) == 15 || D_TAG(dyn + k * ent) == 29))
+                    break;
+            }
+            if (k < n && D_TAG(dyn + k * ent) != 0) continue;
+
+            /* keep the other entries, in place */
+            out = rpath;
+            for (entry = rpath; *entry; entry = *end ? end + 1 : end) {
+                end = strchr(entry, ':');
+                if (!end) end = entry + strlen(entry);
+                if (rpathListed(strip, entry, end - entry)) continue;
+                if (out != rpath) *out++ = ':';
+                memmove(out, entry, end - entry);
+                out += end - entry;
+            }
+            memset(out, 0, rpath + len - out);
+
+            if (!rpath[0]) {
+                /* nothing left, so remove the entry */
+                memmove(dyn + j * ent, dyn + (j + 1) * ent, (n - j - 1) * ent);
+                memset(dyn + (n - 1) * ent, 0, ent);
+                j--;
+            }
+        }
+    }
+
+done:
+    munmap(obj, sz);
+    return 0;
+
+#undef D_VAL
+#undef D_TAG
+#undef IN_OBJ
+#undef SH_LINK
+#undef SH_SIZE
+#undef SH_OFFSET
+#undef SH_TYPE
+#undef SH_FIELD
+#undef SH
+#undef ELF_INT
+}
+
+/* The rpath ltlink recorded adding to a program to run it in place (into the
+ * arena), or NULL if it added none */
+static char *installRpathRecord(struct Options *opt, const char *dir,
+                                const char *base)
+{
+    char *record = arenaLibsPath(opt, dir, base, ".rpath"), *ret, *nl;
+    struct stat sb;
+    FILE *f;
+
+    if (!(f = fopen(record, "r")))
+        return NULL;
+    if (fstat(fileno(f), &sb) != 0) {
+        fclose(f);
+        return NULL;
+    }
+    ret = arenaAlloc(opt, sb.st_size + 1);
+    if (!fgets(ret, sb.st_size + 1, f))
+        ret[0] = '\0';
+    fclose(f);
+    if ((nl = strchr(ret, '\n'))) *nl = '\0';
+    return ret[0] ? ret : NULL;
+}
+
+/* Parse an octal install mode, or return -1 */
+static long installMode(const char *arg)
+{
+    char *end;
+    long mode;
+    if (!arg[0]) return -1;
+    mode = strtol(arg, &end, 8);
+    if (*end || mode < 0 || mode > 07777) return -1;
+    return mode;
+}
+
+/* Does this file already have exactly these contents? */
+static int sameContents(int fd, const char *path, size_t sz)
+{
+    void *a, *b;
+    int dfd, ret;
+
+    if (sz == 0) return 1;
+    if ((dfd = open(path, O_RDONLY)) < 0) return 0;
+    a = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    b = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, dfd, 0);
+    close(dfd);
+    ret = (a != MAP_FAILED && b != MAP_FAILED && !memcmp(a, b, sz));
+    if (a != MAP_FAILED) munmap(a, sz);
+    if (b != MAP_FAILED) munmap(b, sz);
+    return ret;
+}
+
+/* Keep a destination that already has the right contents, fixing its mode
+ * and times. Returns 0 on success, or -1 with errno set. */
+static int installKeep(struct InstallJob *job, struct stat *sb,
+                       struct stat *db, long mode, int preserve)
+{
+    if ((long) (db->st_mode & 07777) != mode && chmod(job->dest, mode) != 0)
+        return -1;
+    if (preserve) {
+        struct timespec times[2];
+        times[0] = sb->st_atim;
+        times[1] = sb->st_mtim;
+        return utimensat(AT_FDCWD, job->dest, times, 0);
+    }
+    return 0;
+}
+
+/* Install one file (or symlink), replacing the destination atomically. Files
+ * whose destination already has the same contents (once any rpath is
+ * stripped) aren't copied again. Returns 0 on success, or -1 with errno
+ * set. */
+static int installFile(struct Options *opt, struct InstallJob *job,
+                       mode_t umaskV, int preserve)
+{
+    struct stat sb, db;
+    char *tmpName;
+    long mode;
+    int in, out, err;
+
+    tmpName = arenaPrintf(opt, "%s.%d", job->dest, (int) getpid());
+
+    if (job->link) {
+        char target[4096], dtarget[4096];
+        ssize_t len, dlen;
+
+        if ((len = readlink(job->src, target, sizeof(target) - 1)) < 0)
+            return -1;
+        target[len] = '\0';
+
+        /* maybe it's already right */
+        if ((dlen = readlink(job->dest, dtarget, sizeof(dtarget) - 1)) == len &&
+            !memcmp(target, dtarget, len))
+            return 0;
+
+        unlink(tmpName);
+        if (symlink(target, tmpName) != 0)
+            return -1;
+        if (rename(tmpName, job->dest) != 0) {
+            err = errno;
+            unlink(tmpName);
+            errno = err;
+            return -1;
+        }
+        return 0;
+    }
+
+    if ((in = open(job->src, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(in, &sb) != 0)
+        goto fail;
+    mode = (job->mode >= 0) ? job->mode : (long) (sb.st_mode & 07777 & ~umaskV);
+
+    /* skip it if it's already there (a program to strip is compared once
+     * it's stripped, below) */
+    if (!job->stripRpath && stat(job->dest, &db) == 0 && S_ISREG(db.st_mode) &&
+        db.st_size == sb.st_size && sameContents(in, job->dest, sb.st_size)) {
+        close(in);
+        return installKeep(job, &sb, &db, mode, preserve);
+    }
+
+    /* copy it into a temporary file next to the destination */
+    unlink(tmpName);
+    if ((out = open(tmpName, O_RDWR|O_CREAT|O_EXCL, 0600)) < 0)
+        goto fail;
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) != 0)
+#endif
+    {
+        if (copyRange(in, 0, out, sb.st_size) != 0)
+            goto failOut;
+    }
+    if (job->stripRpath) {
+        if (elfStripRpath(out, job->stripRpath) != 0)
+            goto failOut;
+        if (stat(job->dest, &db) == 0 && S_ISREG(db.st_mode) &&
+            db.st_size == sb.st_size && sameContents(out, job->dest, sb.st_size)) {
+            close(out);
+            unlink(tmpName);
+            close(in);
+            return installKeep(job, &sb, &db, mode, preserve);
+        }
+    }
+    if (fchmod(out, mode) != 0)
+        goto failOut;
+    if (preserve) {
+        struct timespec times[2];
+        times[0] = sb.st_atim;
+        times[1] = sb.st_mtim;
+        if (futimens(out, times) != 0)
+            goto failOut;
+    }
+    if (close(out) != 0) {
+        out = -1;
+        goto failOut;
+    }
+    close(in);
+
+    if (rename(tmpName, job->dest) != 0) {
+        err = errno;
+        unlink(tmpName);
+        errno = err;
+        return -1;
+    }
+    return 0;
+
+failOut:
+    err = errno;
+    if (out >= 0) close(out);
+    unlink(tmpName);
+    errno = err;
+fail:
+    err = errno;
+    close(in);
+    errno = err;
+    return -1;
+}
+
+/* Install some of the files in a job list: those among the files numbered
+ * first, first + step, etc. Returns 0 on success. */
+static int installSome(struct Options *opt, struct InstallJob *jobs,
+                       size_t count, size_t first, size_t step,
+                       mode_t umaskV, int preserve)
+{
+    size_t i, file = 0;
+
+    for (i = 0; i < count; i++) {
+        long long start;
+        if (jobs[i].link || !jobs[i].dest) continue;
+        if (file++ % step != first) continue;
+        start = traceNow();
+        if (installFile(opt, &jobs[i], umaskV, preserve) != 0) {
+            perror(jobs[i].dest);
+            return -1;
+        }
+        traceFile("write", "install", start, jobs[i].dest);
+    }
+    return 0;
+}
+
+/* Run an install job list. The files are spread over up to --jobs processes,
+ * then the links to them are made. Where several jobs have the same
+ * destination, only the last runs, as if they'd all run in order. Exits on
+ * failure. */
+static void installJobs(struct Options *opt, struct InstallJob *jobs,
+                        size_t count, mode_t umaskV, int preserve)
+{
+    size_t i, j, files = 0;
+    size_t workers;
+    pid_t *pids;
+    int *tokens;
+    int fail = 0, status;
+
+    /* only the last write to each destination matters */
+    for (i = 0; i < count; i++) {
+        for (j = i + 1; j < count; j++) {
+            if (!strcmp(jobs[i].dest, jobs[j].dest)) {
+                jobs[i].dest = NULL;
+                break;
+            }
+        }
+        if (jobs[i].dest && !jobs[i].link)
+            files++;
+    }
+
+    /* copy the files, with a worker for each token we can get */
+    workers = opt->maxJobs > 1 ? (size_t) opt->maxJobs : 1;
+    if (workers > files) workers = files;
+    ORL(tokens, calloc, NULL, (workers + 1, sizeof(int)));
+    for (i = 1; i < workers; i++)
+        if ((tokens[i] = jobTokenTake()) < 0)
+            break;
+    workers = i;
+    if (workers <= 1) {
+        if (installSome(opt, jobs, count, 0, 1, umaskV, preserve) != 0)
+            exit(1);
+
+    } else {
+        ORL(pids, calloc, NULL, (workers, sizeof(pid_t)));
+        for (i = 0; i < workers; i++) {
+            pids[i] = fork();
+            if (pids[i] == 0)
+                _exit(installSome(opt, jobs, count, i, workers, umaskV, preserve) ? 1 : 0);
+            if (pids[i] < 0 && installSome(opt, jobs, count, i, workers, umaskV, preserve) != 0)
+                fail = 1; /* so do it ourselves */
+        }
+        for (i = 0; i < workers; i++) {
+            if (pids[i] <= 0) continue;
+            while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                fail = 1;
+        }
+        for (i = 1; i < workers; i++)
+            jobTokenGive(tokens[i]);
+        free(pids);
+        if (fail)
+            exit(1);
+
+    }
+    free(tokens);
+
+    /* then the links, now that what they point to is there */
+    for (i = 0; i < count; i++) {
+        if (!jobs[i].link || !jobs[i].dest) continue;
+        if (installFile(opt, &jobs[i], umaskV, preserve) != 0) {
+            perror(jobs[i].dest);
+            exit(1);
+        }
+    }
+}
+
+static void ltinstall(struct Options *opt)
+{
+    size_t i, j;
+    char *dir, *base, *ext, *target;
+    struct Buffer installCmd, cpCmd;
+    int haveInst = 0, haveCp = 0;
+
+    /* to install it ourselves */
+    struct InstallJob *jobs = NULL;
+    size_t jobsUsed = 0, jobsSz = 0;
+    int native = !opt->externalInstall, preserve = 0, targetDir;
+    long mode = -1;
+    mode_t umaskV;
+    struct stat sb;
+
+    INIT_BUFFER(installCmd);
+    INIT_BUFFER(cpCmd);
+
+    /* we only know how to do what install itself does */
+    base = arenaBasename(opt, opt->cmd[0], 0);
+    if (strcmp(base, "install") && strcmp(base, "ginstall"))
+        native = 0;
+
+    /* copy in the install command as stands */
+    WRITE_BUFFER(installCmd, opt->cmd[0]);
+    for (i = 1; opt->cmd[i] && opt->cmd[i][0] == '-'; i++) {
+        char *arg = opt->cmd[i];
+        WRITE_BUFFER(installCmd, arg);
+
+        if (!strcmp(arg, "-c")) {
+            /* ignored by every install */
+
+        } else if (!strcmp(arg, "-p")) {
+            preserve = 1;
+
+        } else if (!strcmp(arg, "-m") && opt->cmd[i+1]) {
+            WRITE_BUFFER(installCmd, opt->cmd[++i]);
+            if ((mode = installMode(opt->cmd[i])) < 0)
+                native = 0; /* symbolic */
+
+        } else if (!strncmp(arg, "-m", 2) || !strncmp(arg, "--mode=", 7)) {
+            if ((mode = installMode(arg + (arg[1] == '-' ? 7 : 2))) < 0)
+                native = 0;
+
+        } else {
+            native = 0;
+
+            /* make sure we don't take an option's argument as a file */
+            if ((!strcmp(arg, "-o") || !strcmp(arg, "-g") ||
+                 !strcmp(arg, "-S")) && opt->cmd[i+1])
+                WRITE_BUFFER(installCmd, opt->cmd[++i]);
+
+        }
+    }
+
+    /* and make a cp command for things that install doesn't support */
+    WRITE_BUFFER(cpCmd, "cp");
+    WRITE_BUFFER(cpCmd, "-P");
+
+    /* if the command seems invalid, just run it */
+    if (!opt->cmd[i]) {
+        spawn(opt, opt->cmd);
+        return;
+    }
+
+    /* find the target */
+    for (j = i; opt->cmd[j]; j++);
+    j--;
+    target = opt->cmd[j];
+    opt->cmd[j] = NULL;
+    statsOutput = target;
+    targetDir = (stat(target, &sb) == 0 && S_ISDIR(sb.st_mode));
+
+    /* and go through all the other files */
+    for (; opt->cmd[i]; i++) {
+        char *laFile = NULL;
+
+        /* check if this is a .la file */
+        ext = strrchr(opt->cmd[i], '.');
+        if (ext && !strcmp(ext, ".la"))
+            laFile = opt->cmd[i];
+
+        /* get the directory info */
+        dir = arenaDirname(opt, opt->cmd[i]);
+        base = arenaBasename(opt, opt->cmd[i], 0);
+
+        if (!laFile) {
+            char *libsF;
+            int inPlace;
+
+            haveInst = 1;
+
+            /* check if there's a .libs version */
+            libsF = arenaLibsPath(opt, dir, base, "");
+            inPlace = (access(libsF, F_OK) != 0);
+            if (!inPlace) {
+                /* use that one */
+                WRITE_BUFFER(installCmd, libsF);
+            } else {
+                /* use the provided argument, which may be a program linked
+                 * to run in place */
+                WRITE_BUFFER(installCmd, libsF = opt->cmd[i]);
+            }
+
+            /* install copies what links point to */
+            GROW_ARRAY(opt, jobs, jobsUsed, jobsSz);
+            jobs[jobsUsed].src = libsF;
+            jobs[jobsUsed].dest = base;
+            jobs[jobsUsed].mode = (mode >= 0) ? mode : 0755;
+            jobs[jobsUsed].link = 0;
+            jobs[jobsUsed].stripRpath =
+                inPlace ? installRpathRecord(opt, dir, base) : NULL;
+            jobsUsed++;
+
+        } else {
+            /* install all the files specified in the .la */
+            static const char *vars[] = {"library_names", "old_library", NULL};
+            struct LtFile lt;
+            size_t vi;
+
+            if (ltFileRead(opt, laFile, &lt)) {
+                for (vi = 0; vars[vi]; vi++) {
+                    char *part, *saveptr;
+                    char *dlibs = ltFileGet(&lt, vars[vi]);
+                    if (!dlibs) continue;
+
+                    /* now go one by one through the libs */
+                    part = strtok_r(dlibs, " ", &saveptr);
+                    while (part) {
+                        /* and install it */
+                        char *src = arenaLibsPath(opt, dir, part, "");
+                        haveCp = 1;
+                        WRITE_BUFFER(cpCmd, src);
+
+                        /* cp -P copies links as links, and ignores -m */
+                        GROW_ARRAY(opt, jobs, jobsUsed, jobsSz);
+                        jobs[jobsUsed].src = src;
+                        jobs[jobsUsed].dest = arenaStrdup(opt, part);
+                        jobs[jobsUsed].mode = -1;
+                        jobs[jobsUsed].link =
+                            (lstat(src, &sb) == 0 && S_ISLNK(sb.st_mode));
+                        jobs[jobsUsed].stripRpath = NULL;
+                        jobsUsed++;
+
+                        part = strtok_r(NULL, " ", &saveptr);
+                    }
+                }
+
+                ltFileFree(&lt);
+            }
+
+        }
+
+    }
+
+    /* a target that isn't a directory can only take one file */
+    if (!targetDir && jobsUsed != 1)
+        native = 0;
+
+    for (i = 0; i < jobsUsed; i++)
+        jobs[i].dest = targetDir ?
+            arenaPrintf(opt, "%s/%s", target, jobs[i].dest) : target;
+
+    if (native) {
+        /* show what we're doing, as the commands that would do it */
+        if (haveInst) {
+            WRITE_BUFFER(installCmd, target);
+            WRITE_BUFFER(installCmd, NULL);
+            printCmd(opt, installCmd.buf);
+        }
+        if (haveCp) {
+            WRITE_BUFFER(cpCmd, target);
+            WRITE_BUFFER(cpCmd, NULL);
+            printCmd(opt, cpCmd.buf);
+        }
+
+        umaskV = umask(0);
+        umask(umaskV);
+
+        if (!opt->dryRun)
+            installJobs(opt, jobs, jobsUsed, umaskV, preserve);
+
+    } else {
+        /* now run the commands */
+        if (haveInst) {
+            WRITE_BUFFER(installCmd, target);
+            WRITE_BUFFER(installCmd, NULL);
+            spawn(opt, installCmd.buf);
+        }
+        if (haveCp) {
+            WRITE_BUFFER(cpCmd, target);
+            WRITE_BUFFER(cpCmd, NULL);
+            spawn(opt, cpCmd.buf);
+        }
+
+        /* then take out any rpath for running in place */
+        for (i = 0; !opt->dryRun && i < jobsUsed; i++) {
+            char magic[4];
+            int fd;
+            if (!jobs[i].stripRpath) continue;
+
+            /* scripts needn't be writable */
+            if ((fd = open(jobs[i].dest, O_RDONLY)) >= 0) {
+                if (read(fd, magic, 4) != 4 || memcmp(magic, "\177ELF", 4)) {
+                    close(fd);
+                    continue;
+                }
+                close(fd);
+            }
+
+            if ((fd = open(jobs[i].dest, O_RDWR)) < 0 ||
+                elfStripRpath(fd, jobs[i].stripRpath) != 0) {
+                perror(jobs[i].dest);
+                exit(1);
+            }
+            close(fd);
+        }
+
+    }
+
+    /* and free everything */
+    free(jobs);
+    FREE_BUFFER(cpCmd);
+    FREE_BUFFER(installCmd);
+}
+
+/* If arg is one of our binary runner scripts, return the program it runs and
+ * add its library path to *ldPath. Returns arg if it isn't a runner script. */
+static char *executeUnwrap(struct Options *opt, char *arg, char **ldPath)
+{
+    static const char pathLine[] = "LD_LIBRARY_PATH=\"" BIN_SCRIPT_PATH;
+    struct stat sb;
+    char head[512], *buf, *dirs, *dirsEnd, *prog, *progEnd, *line;
+    ssize_t rd;
+    int fd, i;
+
+    /* it must be a script, so look at the start before reading it all */
+    if ((fd = open(arg, O_RDONLY)) < 0)
+        return arg;
+    while ((rd = read(fd, head, sizeof(head) - 1)) < 0 && errno == EINTR);
+    if (rd < 2 || head[0] != '#' || head[1] != '!') {
+        close(fd);
+        return arg;
+    }
+    head[rd] = '\0';
+
+    if (strncmp(head, BIN_SCRIPT_MAGIC, sizeof(BIN_SCRIPT_MAGIC) - 1)) {
+        close(fd);
+
+        /* only libtool can run its own */
+        line = strchr(head, '\n');
+        for (i = 1; line && i < 4; i++) {
+            char *end = strchr(line + 1, '\n');
+            if (!strncmp(line, GNU_SCRIPT_MAGIC, sizeof(GNU_SCRIPT_MAGIC) - 1)) {
+                if (end) *end = '\0';
+                if (strstr(line, "libtool"))
+                    execLibtool(opt, "%s is a libtool wrapper script", arg);
+                break;
+            }
+            line = end;
+        }
+        return arg;
+    }
+
+    /* it's ours, so read the rest */
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size < rd) {
+        close(fd);
+        return arg;
+    }
+    buf = arenaAlloc(opt, sb.st_size + 1);
+    memcpy(buf, head, rd);
+    if (readAll(fd, buf + rd, sb.st_size - rd) != 0) {
+        close(fd);
+        return arg;
+    }
+    close(fd);
+    buf[sb.st_size] = '\0';
+
+    /* after the header is the library path, then the program */
+    dirs = strchr(buf, '\n');
+    if (dirs) dirs = strchr(dirs + 1, '\n');
+    if (!dirs || strncmp(dirs + 1, pathLine, sizeof(pathLine) - 1) ||
+        !(dirsEnd = strstr(dirs, BIN_SCRIPT_2)))
+        execLibtool(opt, "cannot read %s", arg);
+    dirs += sizeof(pathLine);
+    prog = dirsEnd + sizeof(BIN_SCRIPT_2) - 1;
+    if (!(progEnd = strstr(prog, BIN_SCRIPT_3)))
+        execLibtool(opt, "cannot read %s", arg);
+
+    if (dirsEnd > dirs) {
+        *dirsEnd = '\0';
+        *ldPath = *ldPath ? arenaPrintf(opt, "%s:%s", *ldPath, dirs) : dirs;
+    }
+    *progEnd = '\0';
+    return prog;
+}
+
+static void ltexecute(struct Options *opt)
+{
+    char **cmd, *env, *ldPath, *dlPath = NULL, *wrapperPath = NULL;
+    size_t i;
+
+    /* -dlopen libraries come first */
+    for (i = 0; opt->cmd[i] && !strcmp(opt->cmd[i], "-dlopen"); i += 2) {
+        char *lib = opt->cmd[i+1];
+        char *ext, *dir = NULL;
+
+        if (!lib)
+            execLibtool(opt, "-dlopen without a library");
+
+        ext = strrchr(lib, '.');
+        if (ext && !strcmp(ext, ".la")) {
+            struct LtFile lt;
+            char *dlname, *installed, *libdir;
+
+            if (!ltFileRead(opt, lib, &lt))
+                execLibtool(opt, "cannot read %s", lib);
+            dlname = ltFileGet(&lt, "dlname");
+            installed = ltFileGet(&lt, "installed");
+            libdir = ltFileGet(&lt, "libdir");
+            if (!dlname || !dlname[0])
+                execLibtool(opt, "-dlopen %s, which has no shared library", lib);
+
+            if (installed && !strcmp(installed, "yes") && libdir)
+                dir = arenaStrdup(opt, libdir);
+            else
+                dir = arenaPrintf(opt, "%s/.libs", arenaDirname(opt, lib));
+            ltFileFree(&lt);
+
+        } else if (ext && !strcmp(ext, ".lo")) {
+            dir = arenaPrintf(opt, "%s/.libs", arenaDirname(opt, lib));
+
+        } else if (!opt->quiet) {
+            fprintf(stderr, "mlibtool: warning: -dlopen is ignored for non-libtool libraries and objects\n");
 
         }
 
-        /* and get full paths for them all */
-#define FULLPATH(x) do { \
-        ORL(x ## path, malloc, NULL, (strlen(outDir) + strlen(x ## name) + 8)); \
-        sprintf(x ## path, "%s/.libs/%s", outDir, x ## name); \
+        if (dir)
+            dlPath = dlPath ? arenaPrintf(opt, "%s:%s", dir, dlPath) : dir;
+    }
+
+    cmd = opt->cmd + i;
+    if (!cmd[0])
+        execLibtool(opt, "no command to execute");
+    statsOutput = cmd[0];
+
+    /* swap our runner scripts for the programs they run */
+    for (i = 0; cmd[i]; i++) {
+        char *ext = strrchr(cmd[i], '.');
+        if (cmd[i][0] == '-' ||
+            (ext && (!strcmp(ext, ".la") || !strcmp(ext, ".lo"))))
+            continue;
+        cmd[i] = executeUnwrap(opt, cmd[i], &wrapperPath);
+    }
+
+    /* -dlopen directories go before the caller's library path, and runner
+     * script directories after */
+    env = getenv("LD_LIBRARY_PATH");
+    ldPath = (env && env[0]) ? env : NULL;
+    if (dlPath)
+        ldPath = ldPath ? arenaPrintf(opt, "%s:%s", dlPath, ldPath) : dlPath;
+    if (wrapperPath)
+        ldPath = ldPath ? arenaPrintf(opt, "%s:%s", ldPath, wrapperPath) :
+                          wrapperPath;
+
+    if (opt->dryRun) {
+        if (ldPath && !opt->quiet)
+            fprintf(stderr, "mlibtool: LD_LIBRARY_PATH=%s\n", ldPath);
+        printCmd(opt, cmd);
+        return;
+    }
+
+    if (ldPath)
+        setenv("LD_LIBRARY_PATH", ldPath, 1);
+
+    /* we won't get to exit */
+    statsExit();
+    traceExit();
+    execvp(cmd[0], cmd);
+    perror(cmd[0]);
+    exit(1);
+}
+
+/* In --server mode, mlibtool listens on a unix socket and runs requests
+ * forwarded by clients (ordinary mlibtool invocations with MLIBTOOL_SERVER set
+ * to the socket path), each in a forked worker. The client passes its argv,
+ * cwd, environment, umask and stdio descriptors, and the server replies with
+ * the worker's wait status. Workers inherit the server's memory cache. */
+
+/* a worker handling one request */
+struct ServerWorker {
+    pid_t pid;
+    int client; /* client socket */
+    int cache; /* cache pipe from the worker, or -1 when closed */
+    char *buf;
+    size_t bufused, bufsz;
+};
+
+static const char *serverPath = NULL;
+static int serverSigPipe[2];
+
+/* Signal handlers for the server */
+static void serverSigChld(int sig)
+{
+    int saveErrno = errno;
+    char c = 0;
+    (void) sig;
+    if (write(serverSigPipe[1], &c, 1) < 0) {}
+    errno = saveErrno;
+}
+
+static void serverSigTerm(int sig)
+{
+    (void) sig;
+    unlink(serverPath);
+    _exit(0);
+}
+
+/* Handle one request in a worker. Never returns. */
+static void serverWork(int sock, int cacheFd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    unsigned int len;
+    char *payload, *part, *end, *cwd;
+    int fds[3], i, argc, envc;
+    char **argv, **envp;
+    mode_t mask;
+
+    setpgid(0, 0);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    /* the length and the client's stdio come first */
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    if (recvmsg(sock, &msg, 0) != sizeof(len))
+        _exit(1);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+        _exit(1);
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    /* then the rest of the request */
+    payload = malloc(len + 1);
+    if (!payload || readAll(sock, payload, len) != 0)
+        _exit(1);
+    payload[len] = '\0';
+    end = payload + len;
+    close(sock);
+
+    /* take over the client's stdio */
+    for (i = 0; i < 3; i++) {
+        if (dup2(fds[i], i) < 0) _exit(1);
+        if (fds[i] > 2) close(fds[i]);
+    }
+
+    /* payload: umask, cwd, argc, argv..., envc, env... */
+#define NEXT_PART() do { \
+    if (part >= end) _exit(1); \
+    part += strlen(part) + 1; \
 } while (0)
-        FULLPATH(so);
-        if (!avoidVersion) {
-            FULLPATH(long);
-            FULLPATH(link);
-        }
-#undef FULLPATH
+    part = payload;
+    mask = strtol(part, NULL, 8);
+    NEXT_PART();
+    cwd = part;
+    NEXT_PART();
+    argc = atoi(part);
+    ORX(argv, calloc, NULL, (argc + 1, sizeof(char *)));
+    for (i = 0; i < argc; i++) {
+        NEXT_PART();
+        argv[i] = part;
+    }
+    NEXT_PART();
+    envc = atoi(part);
+    ORX(envp, calloc, NULL, (envc + 1, sizeof(char *)));
+    for (i = 0; i < envc; i++) {
+        NEXT_PART();
+        envp[i] = part;
+    }
+#undef NEXT_PART
 
-        /* unlink anything that already exists */
-        unlink(sopath);
-        if (longpath)
-            unlink(longpath);
-        if (linkpath)
-            unlink(linkpath);
+    if (chdir(cwd) != 0) {
+        perror(cwd);
+        exit(1);
+    }
+    umask(mask);
+    environ = envp;
 
-        /* set up the link command */
-        ORL(sonameFlag, malloc, NULL, (strlen(soname) + 8));
-        sprintf(sonameFlag, "-Wl,-h,%s", soname);
-        WRITE_BUFFER(outCmd, "-shared");
-        WRITE_BUFFER(outCmd, sonameFlag);
-        WRITE_BUFFER(tofree, sonameFlag);
-        outCmd.buf[outNamePos] = longpath ? longpath : sopath;
+    /* now just act like a normal mlibtool */
+    inServerWorker = 1;
+    memCacheFd = cacheFd;
+    exit(main(argc, argv));
+}
 
-        /* link */
-        WRITE_BUFFER(outCmd, NULL);
-        spawn(opt, outCmd.buf);
-        outCmd.bufused--;
+/* Read cache records sent by a worker. If all is set, read until EOF. */
+static void serverReadCache(struct ServerWorker *w, int all)
+{
+    ssize_t rd;
+    size_t i, start;
 
-        if (!opt->dryRun && !avoidVersion) {
-            /* link in the shorter names */
-            if ((tmpi = symlink(longname, sopath)) < 0) {
-                perror(sopath);
-                exit(1);
+    do {
+        if (w->bufsz - w->bufused < 4096) {
+            w->bufsz = w->bufsz ? w->bufsz * 2 : 8192;
+            ORX(w->buf, realloc, NULL, (w->buf, w->bufsz));
+        }
+        rd = read(w->cache, w->buf + w->bufused, w->bufsz - w->bufused);
+        if (rd < 0 && errno == EINTR) continue;
+        if (rd <= 0) {
+            close(w->cache);
+            w->cache = -1;
+            break;
+        }
+        w->bufused += rd;
+
+        /* each record is four NUL-terminated strings */
+        start = 0;
+        while (1) {
+            char *fields[4];
+            size_t nf = 0;
+            for (i = start; i < w->bufused && nf < 4; i++) {
+                if (w->buf[i] == '\0') {
+                    fields[nf++] = NULL;
+                }
             }
-            if ((tmpi = symlink(longname, linkpath)) < 0) {
-                perror(linkpath);
-                exit(1);
+            if (nf < 4) break;
+
+            fields[0] = w->buf + start;
+            fields[1] = fields[0] + strlen(fields[0]) + 1;
+            fields[2] = fields[1] + strlen(fields[1]) + 1;
+            fields[3] = fields[2] + strlen(fields[2]) + 1;
+            {
+                long long mtime = 0, size = 0;
+                sscanf(fields[2], "%lld %lld", &mtime, &size);
+                memCacheInsert(fields[0], fields[1], mtime, size, fields[3]);
             }
+            start = i;
         }
+        memmove(w->buf, w->buf + start, w->bufused - start);
+        w->bufused -= start;
+    } while (all);
+}
+
+/* Is the peer on this socket running as our user? The server runs whatever
+ * it's asked to, so it mustn't take requests from anyone else. */
+static int serverPeerIsUs(int fd)
+{
+#if defined(__linux__) && defined(SO_PEERCRED)
+    /* struct ucred, which glibc only declares with _GNU_SOURCE */
+    struct {
+        pid_t pid;
+        uid_t uid;
+        gid_t gid;
+    } cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 ||
+        len != sizeof(cred))
+        return 0;
+    return cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(fd, &uid, &gid) != 0)
+        return 0;
+    return uid == geteuid();
+#endif
+}
 
-        free(sopath);
-        free(longpath);
-        free(linkpath);
+/* Run the server. Never returns. */
+static void serverRun(struct Options *opt, const char *path, int idleTimeout)
+{
+    struct sockaddr_un addr;
+    struct ServerWorker *workers = NULL;
+    size_t workersUsed = 0, workersSz = 0, i;
+    struct pollfd *pfds = NULL;
+    struct sigaction sa;
+    mode_t umaskV;
+    int sock, tmpi;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "mlibtool: socket path too long: %s\n", path);
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* don't steal the socket from a running server */
+    ORX(sock, socket, -1, (AF_UNIX, SOCK_STREAM, 0));
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "mlibtool: a server is already running on %s\n", path);
+        exit(1);
+    }
+    close(sock);
+    unlink(path);
+
+    /* only we may connect */
+    ORX(sock, socket, -1, (AF_UNIX, SOCK_STREAM, 0));
+    umaskV = umask(077);
+    ORX(tmpi, bind, -1, (sock, (struct sockaddr *) &addr, sizeof(addr)));
+    umask(umaskV);
+    ORX(tmpi, listen, -1, (sock, 64));
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    serverPath = path;
+
+    ORX(tmpi, pipe, -1, (serverSigPipe));
+    for (i = 0; i < 2; i++) {
+        fcntl(serverSigPipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(serverSigPipe[i], F_SETFL, O_NONBLOCK);
     }
+    /* signal() may reset the handler, so use sigaction */
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = serverSigChld;
+    sigaction(SIGCHLD, &sa, NULL);
+    sa.sa_handler = serverSigTerm;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-    /* finally, make the .la file */
-    if (buildLib) {
-        FILE *f = fopen(outName, "w");
-        if (!f) {
-            perror(outName);
-            execLibtool(opt);
+    if (!opt->quiet)
+        fprintf(stderr, "mlibtool: serving on %s\n", path);
+
+    while (1) {
+        size_t npfds = 0;
+        int ready;
+
+        /* wait for something to happen */
+        ORX(pfds, realloc, NULL, (pfds, (2 + 2 * workersUsed) * sizeof(struct pollfd)));
+        pfds[npfds].fd = sock;
+        pfds[npfds++].events = POLLIN;
+        pfds[npfds].fd = serverSigPipe[0];
+        pfds[npfds++].events = POLLIN;
+        for (i = 0; i < workersUsed; i++) {
+            /* the request is still pending on the client socket, so only
+             * watch for hangups */
+            pfds[npfds].fd = workers[i].client;
+            pfds[npfds++].events = 0;
+            pfds[npfds].fd = workers[i].cache;
+            pfds[npfds++].events = POLLIN;
         }
 
-        fprintf(f, SANE_HEADER
-                   PACKAGE_HEADER);
+        ready = poll(pfds, npfds, workersUsed ? -1 : idleTimeout * 1000);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("mlibtool: poll");
+            unlink(path);
+            exit(1);
+        }
+        if (ready == 0) {
+            /* idle for too long */
+            unlink(path);
+            exit(0);
+        }
 
-        if (soname) {
-            /* we have a .so */
-            fprintf(f, "dlname='%s'\n", soname);
+        /* cache records and hung-up clients */
+        for (i = 0; i < workersUsed; i++) {
+            struct ServerWorker *w = &workers[i];
+            if (pfds[2 + 2 * i + 1].revents && w->cache >= 0)
+                serverReadCache(w, 0);
+            if (pfds[2 + 2 * i].revents) {
+                /* the client is gone, so nobody wants this result */
+                kill(-w->pid, SIGTERM);
+                kill(w->pid, SIGTERM);
+            }
+        }
 
-            if (longname && linkname) {
-                /* and other names */
-                fprintf(f, "library_names='%s %s %s'\n",
-                        longname, soname, linkname);
-            } else {
-                fprintf(f, "library_names='%s'\n", soname);
+        /* finished workers */
+        if (pfds[1].revents) {
+            char cbuf[64];
+            pid_t pid;
+
+            while (read(serverSigPipe[0], cbuf, sizeof(cbuf)) > 0);
+            while ((pid = waitpid(-1, &tmpi, WNOHANG)) > 0) {
+                for (i = 0; i < workersUsed; i++) {
+                    struct ServerWorker *w = &workers[i];
+                    if (w->pid != pid) continue;
+
+                    if (w->cache >= 0)
+                        serverReadCache(w, 1);
+                    writeAll(w->client, &tmpi, sizeof(tmpi));
+                    close(w->client);
+                    free(w->buf);
+                    workers[i] = workers[--workersUsed];
+                    break;
+                }
             }
-        } else {
-            fprintf(f, "dlname=''\nlibrary_names=''\n");
         }
 
-        fprintf(f, "old_library='%s'\n"
-                   "inherited_linker_flags=''\n", afile ? afile : "");
+        /* and new clients */
+        if (pfds[0].revents) {
+            int client, cachePipe[2];
+            pid_t pid;
 
-        fprintf(f, "dependency_libs='");
-        for (i = 0; i < dependencyLibs.bufused; i++)
-            fprintf(f, " %s", dependencyLibs.buf[i]);
-        fprintf(f, "'\n");
+            client = accept(sock, NULL, NULL);
+            if (client < 0) continue;
+            if (!serverPeerIsUs(client)) {
+                close(client);
+                continue;
+            }
+            fcntl(client, F_SETFD, FD_CLOEXEC);
 
-        /* version info */
-        fprintf(f, "current=%d\n"
-                   "age=%d\n"
-                   "revision=%d\n",
-                   (major + minor) /* current is weird */,
-                   minor,
-                   revision);
+            if (pipe(cachePipe) != 0) {
+                close(client);
+                continue;
+            }
+            fcntl(cachePipe[0], F_SETFD, FD_CLOEXEC);
+            fcntl(cachePipe[1], F_SETFD, FD_CLOEXEC);
+
+            fflush(NULL);
+            pid = fork();
+            if (pid == 0) {
+                close(sock);
+                close(serverSigPipe[0]);
+                close(serverSigPipe[1]);
+                close(cachePipe[0]);
+                for (i = 0; i < workersUsed; i++) {
+                    close(workers[i].client);
+                    if (workers[i].cache >= 0) close(workers[i].cache);
+                }
+                serverWork(client, cachePipe[1]);
+            }
+            close(cachePipe[1]);
+            if (pid < 0) {
+                close(cachePipe[0]);
+                close(client);
+                continue;
+            }
 
-        fprintf(f, "installed=no\n"
-                   "shouldnotlink=%s\n"
-                   "dlopen=''\n"
-                   "dlpreopen=''\n"
-                   "libdir='%s'\n",
-                   (module ? "yes" : "no"),
-                   (rpath ? rpath : ""));
+            if (workersUsed >= workersSz) {
+                workersSz = workersSz ? workersSz * 2 : 16;
+                ORX(workers, realloc, NULL, (workers, workersSz * sizeof(struct ServerWorker)));
+            }
+            memset(&workers[workersUsed], 0, sizeof(struct ServerWorker));
+            workers[workersUsed].pid = pid;
+            workers[workersUsed].client = client;
+            workers[workersUsed].cache = cachePipe[0];
+            workersUsed++;
+        }
+    }
+}
 
-        fclose(f);
+/* Forward this invocation to a server, if one is listening on path. Only
+ * returns if there's no server. */
+static void serverClient(const char *path, int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    char cwd[4096], mask[32], argcS[32], envcS[32];
+    char *buf;
+    unsigned int len;
+    int sock, fds[3] = {0, 1, 2}, status, i, envc;
+    mode_t umaskV;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) return;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return;
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        !getcwd(cwd, sizeof(cwd))) {
+        close(sock);
+        return;
     }
 
-    free(afile);
-    free(soname);
-    free(longname);
-    free(linkname);
-    free(libsDir);
-    free(outBaseC);
-    free(outDirC);
+    /* build the request: umask, cwd, argc, argv..., envc, env... */
+    umaskV = umask(0);
+    umask(umaskV);
+    sprintf(mask, "%o", (unsigned int) umaskV);
+    sprintf(argcS, "%d", argc);
+    for (envc = 0; environ[envc]; envc++);
+    sprintf(envcS, "%d", envc);
+
+#define ADD_PART(part) do { \
+    const char *part_ = (part); \
+    size_t len_ = strlen(part_) + 1; \
+    if (buf) memcpy(buf + len, part_, len_); \
+    len += len_; \
+} while (0)
+    /* the first pass measures, the second copies */
+    buf = NULL;
+    len = 0;
+    while (1) {
+        ADD_PART(mask);
+        ADD_PART(cwd);
+        ADD_PART(argcS);
+        for (i = 0; i < argc; i++)
+            ADD_PART(argv[i]);
+        ADD_PART(envcS);
+        for (i = 0; i < envc; i++)
+            ADD_PART(environ[i]);
+
+        if (buf) break;
+        ORX(buf, malloc, NULL, (len));
+        len = 0;
+    }
+#undef ADD_PART
+
+    /* send the length along with our stdio */
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctl, 0, sizeof(ctl));
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, 0) != sizeof(len)) {
+        /* nothing has happened yet, so just do it ourselves */
+        close(sock);
+        return;
+    }
 
-    for (i = 0; i < tofree.bufused; i++) free(tofree.buf[i]);
+    /* then the request, and wait for the result */
+    if (writeAll(sock, buf, len) != 0 ||
+        readAll(sock, &status, sizeof(status)) != 0) {
+        fprintf(stderr, "mlibtool: lost connection to server %s\n", path);
+        exit(1);
+    }
 
-    FREE_BUFFER(tofree);
-    FREE_BUFFER(dependencyLibs);
-    FREE_BUFFER(libDirs);
-    FREE_BUFFER(outAr);
-    FREE_BUFFER(outCmd);
+    if (WIFEXITED(status))
+        exit(WEXITSTATUS(status));
+    if (WIFSIGNALED(status)) {
+        signal(WTERMSIG(status), SIG_DFL);
+        raise(WTERMSIG(status));
+        exit(128 + WTERMSIG(status));
+    }
+    exit(1);
 }
 
-static void ltinstall(struct Options *opt)
+/* In --batch mode, mlibtool reads libtool command lines from a file and runs
+ * them as jobs, like a server running requests: each job is a forked worker
+ * calling main, so a job failing (or handing over to libtool) only ends that
+ * job, and later jobs inherit the memory cache of earlier ones. Each line is
+ * split into words as sh would, and is either a command, or a job name
+ * followed by a colon and, optionally, the names of jobs it must follow and
+ * --, then the command:
+ *
+ *     a.lo: libtool --mode=compile cc -c a.c
+ *     liba.la: a.lo -- libtool --mode=link cc a.lo -o liba.la
+ *
+ * Unnamed jobs are named by their line number. The status of each job goes
+ * to stdout as it finishes, and its output to stderr after it. */
+
+/* a job in a batch */
+struct BatchJob {
+    struct ServerWorker w;
+    char *name;
+    char **argv;
+    int argc;
+    size_t line;
+    size_t pending; /* jobs it must still wait for */
+    size_t *dependents, dependentsUsed, dependentsSz;
+    FILE *out;
+    int token; /* the jobserver token it runs on */
+};
+
+/* Split the next line of a batch file into words, in place. Returns 0 at the
+ * end of the file. */
+static int batchLine(struct Options *opt, char **inp, struct Buffer *words,
+                     size_t *line)
 {
-    size_t i, j;
-    char *dirC, *dir, *baseC, *base, *ext, *target;
-    struct Buffer installCmd, cpCmd, tofree;
-    int haveInst = 0, haveCp = 0;
+    char *in = *inp, *out = in;
+    int inWord = 0, quote = 0;
 
-    INIT_BUFFER(installCmd);
-    INIT_BUFFER(cpCmd);
-    INIT_BUFFER(tofree);
+    words->bufused = 0;
+    if (!*in) return 0;
 
-    /* copy in the install command as stands */
-    WRITE_BUFFER(installCmd, opt->cmd[0]);
-    for (i = 1; opt->cmd[i] && opt->cmd[i][0] == '-'; i++) {
-        WRITE_BUFFER(installCmd, opt->cmd[i]);
-    }
+    for (; *in; in++) {
+        char c = *in;
 
-    /* and make a cp command for things that install doesn't support */
-    WRITE_BUFFER(cpCmd, "cp");
-    WRITE_BUFFER(cpCmd, "-P");
+        if (quote == '\'') {
+            if (c == '\'') quote = 0;
+            else *out++ = c;
+            if (c == '\n') (*line)++;
+            continue;
+        }
 
-    /* if the command seems invalid, just run it */
-    if (!opt->cmd[i]) {
-        spawn(opt, opt->cmd);
-        return;
-    }
+        if (c == '\\' && in[1]) {
+            c = *++in;
+            if (c == '\n') {
+                /* a continued line */
+                (*line)++;
+                continue;
+            }
+            if (quote == '"' && !strchr("\"\\$`", c))
+                *out++ = '\\';
+
+        } else if (c == '"') {
+            quote = quote ? 0 : '"';
+            if (!inWord) {
+                WRITE_BUFFER(*words, out);
+                inWord = 1;
+            }
+            continue;
 
-    /* find the target */
-    for (j = i; opt->cmd[j]; j++);
-    j--;
-    target = opt->cmd[j];
-    opt->cmd[j] = NULL;
+        } else if (quote) {
+            /* taken literally */
 
-    /* and go through all the other files */
-    for (; opt->cmd[i]; i++) {
-        char *laFile = NULL;
+        } else if (c == '\'') {
+            quote = '\'';
+            if (!inWord) {
+                WRITE_BUFFER(*words, out);
+                inWord = 1;
+            }
+            continue;
 
-        /* check if this is a .la file */
-        ext = strrchr(opt->cmd[i], '.');
-        if (ext && !strcmp(ext, ".la"))
-            laFile = opt->cmd[i];
+        } else if (c == '#' && !inWord) {
+            while (in[1] && in[1] != '\n') in++;
+            continue;
 
-        /* get the directory info */
-        ORL(dirC, strdup, NULL, (opt->cmd[i]));
-        dir = dirname(dirC);
-        ORL(baseC, strdup, NULL, (opt->cmd[i]));
-        base = basename(baseC);
+        } else if (c == ' ' || c == '\t' || c == '\n') {
+            if (inWord) {
+                *out++ = '\0';
+                inWord = 0;
+            }
+            if (c == '\n') {
+                in++;
+                break;
+            }
+            continue;
 
-        if (!laFile) {
-            char *libsF;
+        }
 
-            haveInst = 1;
+        if (c == '\n') (*line)++;
+        if (!inWord) {
+            WRITE_BUFFER(*words, out);
+            inWord = 1;
+        }
+        *out++ = c;
+    }
+    if (inWord) *out = '\0';
 
-            /* check if there's a .libs version */
-            ORL(libsF, malloc, NULL, (strlen(dir) + strlen(base) + 8));
-            sprintf(libsF, "%s/.libs/%s", dir, base);
-            if (access(libsF, F_OK) == 0) {
-                /* use that one */
-                WRITE_BUFFER(installCmd, libsF);
-                WRITE_BUFFER(tofree, libsF);
-            } else {
-                /* use the provided argument */
-                WRITE_BUFFER(installCmd, opt->cmd[i]);
-                free(libsF);
+    (*line)++;
+    *inp = in;
+    return 1;
+}
+
+/* Find a job by name, or return (size_t) -1 */
+static size_t batchFind(struct BatchJob *jobs, size_t *index, size_t indexSz,
+                        const char *name)
+{
+    size_t i = hashStr(name) & (indexSz - 1);
+    for (; index[i]; i = (i + 1) & (indexSz - 1)) {
+        if (!strcmp(jobs[index[i] - 1].name, name))
+            return index[i] - 1;
+    }
+    return (size_t) -1;
+}
+
+/* Report that a job is finished, and release or skip the jobs that follow it.
+ * Returns the number of jobs that finished (including skipped ones). */
+static size_t batchFinish(struct BatchJob *jobs, size_t j, int status,
+                          size_t *ready, size_t *readyUsed)
+{
+    struct BatchJob *job = &jobs[j];
+    size_t i, finished = 1;
+    char buf[4096];
+    size_t rd;
+
+    /* its output first */
+    if (job->out) {
+        rewind(job->out);
+        if ((rd = fread(buf, 1, sizeof(buf), job->out)) > 0)
+            fprintf(stderr, "mlibtool: %s:\n", job->name);
+        for (; rd > 0; rd = fread(buf, 1, sizeof(buf), job->out))
+            fwrite(buf, 1, rd, stderr);
+        fclose(job->out);
+        job->out = NULL;
+    }
+
+    if (status < 0)
+        printf("%s: skipped\n", job->name);
+    else if (WIFEXITED(status))
+        printf("%s: %d\n", job->name, WEXITSTATUS(status));
+    else
+        printf("%s: signal %d\n", job->name, WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    fflush(stdout);
+
+    for (i = 0; i < job->dependentsUsed; i++) {
+        size_t d = job->dependents[i];
+        if (status != 0) {
+            /* nothing that needs a failed job can run */
+            if (jobs[d].pending) {
+                jobs[d].pending = 0;
+                finished += batchFinish(jobs, d, -1, ready, readyUsed);
             }
+        } else if (jobs[d].pending && --jobs[d].pending == 0) {
+            ready[(*readyUsed)++] = d;
+        }
+    }
+    return finished;
+}
 
-        } else {
-            /* install all the files specified in the .la */
-            FILE *f;
+/* Run a batch. optEnd is the end of our own options in argv, which each job
+ * gets too, except --batch and --jobs. Never returns. */
+static void batchRun(struct Options *opt, const char *path, int optEnd,
+                     char **argv)
+{
+    struct BatchJob *jobs = NULL;
+    size_t jobsUsed = 0, jobsSz = 0;
+    size_t *index, indexSz = 16, *ready, readyUsed = 0, readyNext = 0;
+    size_t running = 0, finished = 0, i, j, line = 1, start;
+    struct Buffer words, common;
+    struct pollfd *pfds = NULL;
+    struct sigaction sa;
+    char *buf = NULL, *in;
+    size_t bufused = 0, bufsz = 0;
+    ssize_t rd;
+    int fd, fail = 0, tmpi, ownToken = 1;
 
-            /* open the file */
-            f = fopen(laFile, "r");
-            if (f) {
-                char *lbuf;
-                size_t lbufsz, lbufused;
-                lbufsz = 32;
-                ORL(lbuf, malloc, NULL, (lbufsz));
-
-                while (fgets(lbuf, lbufsz, f)) {
-                    lbufused = strlen(lbuf);
-
-                    /* read in the remainder of the line */
-                    while (lbuf[lbufused-1] != '\n') {
-                        lbufsz *= 2;
-                        ORL(lbuf, realloc, NULL, (lbuf, lbufsz));
-                        if (!fgets(lbuf + lbufused, lbufsz - lbufused, f)) break;
-                        lbufused = strlen(lbuf);
-                    }
+    /* read the whole batch */
+    if (!strcmp(path, "-")) {
+        fd = 0;
+    } else if ((fd = open(path, O_RDONLY)) < 0) {
+        perror(path);
+        exit(1);
+    }
+    do {
+        if (bufsz - bufused < 4096) {
+            bufsz = bufsz ? bufsz * 2 : 65536;
+            ORX(buf, realloc, NULL, (buf, bufsz));
+        }
+        rd = read(fd, buf + bufused, bufsz - bufused - 1);
+        if (rd < 0 && errno == EINTR) rd = 1;
+        else if (rd < 0) {
+            perror(path);
+            exit(1);
+        } else {
+            bufused += rd;
+        }
+    } while (rd > 0);
+    buf[bufused] = '\0';
+    if (fd != 0) close(fd);
+
+    /* the options every job gets */
+    INIT_BUFFER(common);
+    WRITE_BUFFER(common, argv[0]);
+    for (i = 1; i < (size_t) optEnd; i++) {
+        char *arg = argv[i];
+        if (!strcmp(arg, "--batch") || !strcmp(arg, "-j"))
+            i++;
+        else if (strncmp(arg, "--batch=", 8) && strncmp(arg, "--jobs=", 7) &&
+                 strncmp(arg, "-j", 2))
+            WRITE_BUFFER(common, arg);
+    }
 
-                    /* is this a library_names or old_library line? */
-                    if (!strncmp(lbuf, "library_names='", 15) ||
-                            !strncmp(lbuf, "old_library='", 13)) {
-                        char *part, *saveptr;
-                        char *dlibs = lbuf + 13 + (lbuf[0] == 'l' ? 2 : 0);
-                        char *end = strrchr(dlibs, '\'');
-                        if (end) *end = '\0';
-                        if (!dlibs[0]) continue;
-
-                        /* now go one by one through the libs */
-                        part = strtok_r(dlibs, " ", &saveptr);
-                        while (part) {
-                            /* and install it */
-                            char *fullName;
-                            ORL(fullName, malloc, NULL, (strlen(dir) + strlen(part) + 8));
-                            sprintf(fullName, "%s/.libs/%s", dir, part);
-
-                            haveCp = 1;
-                            WRITE_BUFFER(cpCmd, fullName);
-                            WRITE_BUFFER(tofree, fullName);
-
-                            part = strtok_r(NULL, " ", &saveptr);
-                        }
-                    }
+    /* then the jobs */
+    INIT_BUFFER(words);
+    in = buf;
+    for (start = line; batchLine(opt, &in, &words, &line); start = line) {
+        struct BatchJob *job;
+        size_t first = 0, len;
+
+        if (!words.bufused) continue;
+        GROW_ARRAY(opt, jobs, jobsUsed, jobsSz);
+        job = &jobs[jobsUsed++];
+        memset(job, 0, sizeof(*job));
+        job->line = start;
+
+        /* maybe a name and what it depends on */
+        len = strlen(words.buf[0]);
+        if (len > 1 && words.buf[0][len-1] == ':') {
+            words.buf[0][len-1] = '\0';
+            job->name = words.buf[0];
+            first = 1;
+            for (i = 1; i < words.bufused && strcmp(words.buf[i], "--"); i++);
+            if (i < words.bufused) {
+                /* keep the names of its dependencies in dependents for now */
+                for (j = 1; j < i; j++) {
+                    GROW_ARRAY(opt, job->dependents, job->dependentsUsed, job->dependentsSz);
+                    job->dependents[job->dependentsUsed++] = (size_t) (words.buf[j] - buf);
                 }
-
-                free(lbuf);
-                fclose(f);
+                first = i + 1;
             }
-
+        } else {
+            job->name = arenaPrintf(opt, "%d", (int) job->line);
         }
 
-        free(baseC);
-        free(dirC);
+        job->argc = common.bufused + words.bufused - first;
+        ORX(job->argv, calloc, NULL, (job->argc + 1, sizeof(char *)));
+        memcpy(job->argv, common.buf, common.bufused * sizeof(char *));
+        memcpy(job->argv + common.bufused, words.buf + first,
+               (words.bufused - first) * sizeof(char *));
+    }
+    FREE_BUFFER(words);
+    FREE_BUFFER(common);
+
+    /* index the names */
+    while (indexSz < jobsUsed * 2) indexSz *= 2;
+    ORX(index, calloc, NULL, (indexSz, sizeof(size_t)));
+    for (i = 0; i < jobsUsed; i++) {
+        if (batchFind(jobs, index, indexSz, jobs[i].name) != (size_t) -1) {
+            fprintf(stderr, "%s:%d: job %s is already defined\n", path,
+                    (int) jobs[i].line, jobs[i].name);
+            exit(1);
+        }
+        for (j = hashStr(jobs[i].name) & (indexSz - 1); index[j];
+             j = (j + 1) & (indexSz - 1));
+        index[j] = i + 1;
+    }
 
+    /* and turn dependencies into dependents */
+    for (i = 0; i < jobsUsed; i++) {
+        size_t *deps = jobs[i].dependents, depsUsed = jobs[i].dependentsUsed;
+        jobs[i].dependents = NULL;
+        jobs[i].dependentsUsed = jobs[i].dependentsSz = 0;
+        for (j = 0; j < depsUsed; j++) {
+            char *name = buf + deps[j];
+            size_t d = batchFind(jobs, index, indexSz, name);
+            if (d == (size_t) -1) {
+                fprintf(stderr, "%s:%d: no job named %s\n", path,
+                        (int) jobs[i].line, name);
+                exit(1);
+            }
+            GROW_ARRAY(opt, jobs[d].dependents, jobs[d].dependentsUsed, jobs[d].dependentsSz);
+            jobs[d].dependents[jobs[d].dependentsUsed++] = i;
+            jobs[i].pending++;
+        }
+        free(deps);
     }
 
-    /* now run the commands */
-    if (haveInst) {
-        WRITE_BUFFER(installCmd, target);
-        WRITE_BUFFER(installCmd, NULL);
-        spawn(opt, installCmd.buf);
+    ORX(ready, malloc, NULL, ((jobsUsed + 1) * sizeof(size_t)));
+    for (i = 0; i < jobsUsed; i++)
+        if (!jobs[i].pending)
+            ready[readyUsed++] = i;
+
+    /* know when workers finish, as the server does */
+    ORX(tmpi, pipe, -1, (serverSigPipe));
+    for (i = 0; i < 2; i++) {
+        fcntl(serverSigPipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(serverSigPipe[i], F_SETFL, O_NONBLOCK);
     }
-    if (haveCp) {
-        WRITE_BUFFER(cpCmd, target);
-        WRITE_BUFFER(cpCmd, NULL);
-        spawn(opt, cpCmd.buf);
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = serverSigChld;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    ORX(pfds, calloc, NULL, (jobsUsed + 1, sizeof(struct pollfd)));
+    while (finished < jobsUsed) {
+        size_t npfds = 0;
+
+        /* start whatever we can */
+        while (readyNext < readyUsed && running < (size_t) opt->maxJobs) {
+            struct BatchJob *job = &jobs[ready[readyNext]];
+            int cachePipe[2];
+            pid_t pid;
+
+            if (ownToken) {
+                job->token = JOB_OWN_TOKEN;
+                ownToken = 0;
+            } else if ((job->token = jobTokenTake()) < 0) {
+                break;
+            }
+            readyNext++;
+
+            if (!(job->out = tmpfile()) || pipe(cachePipe) != 0) {
+                perror("mlibtool");
+                exit(1);
+            }
+            fcntl(cachePipe[0], F_SETFD, FD_CLOEXEC);
+            fcntl(cachePipe[1], F_SETFD, FD_CLOEXEC);
+
+            fflush(NULL);
+            pid = fork();
+            if (pid == 0) {
+                close(serverSigPipe[0]);
+                close(serverSigPipe[1]);
+                close(cachePipe[0]);
+                for (i = 0; i < jobsUsed; i++)
+                    if (jobs[i].w.pid > 0 && jobs[i].w.cache >= 0)
+                        close(jobs[i].w.cache);
+                signal(SIGCHLD, SIG_DFL);
+                if (dup2(fileno(job->out), 1) < 0 || dup2(fileno(job->out), 2) < 0)
+                    _exit(1);
+
+                /* now just act like a normal mlibtool */
+                inServerWorker = 1;
+                memCacheFd = cachePipe[1];
+                exit(main(job->argc, job->argv));
+            }
+            close(cachePipe[1]);
+            if (pid < 0) {
+                perror("mlibtool: fork");
+                exit(1);
+            }
+            job->w.pid = pid;
+            job->w.cache = cachePipe[0];
+            running++;
+        }
+
+        if (!running) {
+            /* the rest are waiting on each other */
+            for (i = 0; i < jobsUsed; i++) {
+                if (jobs[i].pending) {
+                    fprintf(stderr, "%s:%d: job %s is in a dependency cycle\n", path,
+                            (int) jobs[i].line, jobs[i].name);
+                    jobs[i].pending = 0;
+                    finished += batchFinish(jobs, i, -1, ready, &readyUsed);
+                    fail = 1;
+                }
+            }
+            break;
+        }
+
+        /* wait for something to happen */
+        pfds[npfds].fd = serverSigPipe[0];
+        pfds[npfds++].events = POLLIN;
+        for (i = 0; i < jobsUsed; i++) {
+            if (jobs[i].w.pid <= 0 || jobs[i].w.cache < 0) continue;
+            pfds[npfds].fd = jobs[i].w.cache;
+            pfds[npfds++].events = POLLIN;
+        }
+        if (poll(pfds, npfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("mlibtool: poll");
+            exit(1);
+        }
+
+        /* cache records */
+        for (i = 0, j = 1; i < jobsUsed; i++) {
+            if (jobs[i].w.pid <= 0 || jobs[i].w.cache < 0) continue;
+            if (pfds[j++].revents)
+                serverReadCache(&jobs[i].w, 0);
+        }
+
+        /* and finished jobs */
+        if (pfds[0].revents) {
+            char cbuf[64];
+            pid_t pid;
+
+            while (read(serverSigPipe[0], cbuf, sizeof(cbuf)) > 0);
+            while ((pid = waitpid(-1, &tmpi, WNOHANG)) > 0) {
+                for (i = 0; i < jobsUsed; i++) {
+                    struct BatchJob *job = &jobs[i];
+                    if (job->w.pid != pid) continue;
+
+                    if (job->w.cache >= 0)
+                        serverReadCache(&job->w, 1);
+                    free(job->w.buf);
+                    job->w.pid = -1;
+                    running--;
+                    if (job->token == JOB_OWN_TOKEN)
+                        ownToken = 1;
+                    jobTokenGive(job->token);
+                    if (tmpi != 0) fail = 1;
+                    finished += batchFinish(jobs, i, tmpi, ready, &readyUsed);
+                    break;
+                }
+            }
+        }
     }
 
-    /* and free everything */
-    for (i = 0; i < tofree.bufused; i++) free(tofree.buf[i]);
-    FREE_BUFFER(tofree);
-    FREE_BUFFER(cpCmd);
-    FREE_BUFFER(installCmd);
+    if (finished < jobsUsed) fail = 1;
+    exit(fail);
 }
 
 #endif /* _POSIX_VERSION */